@@ -0,0 +1,290 @@
+/*
+ * Micro-benchmarks of the module's pure hot functions.
+ *
+ * Usage: pmopenprovider_bench [--filter=<substring>] [--fixtures=<dir>]
+ *                             [--save=<file>] [--baseline=<file>] [--tolerance=<percent>]
+ *
+ * With --baseline the run fails (exit code 1) when any benchmark is slower
+ * than the saved result by more than the tolerance (25% by default).
+ */
+#include "../pmopenprovider_util.h"
+#include <mgr/mgrlog.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+MODULE("pmopenprovider_bench");
+
+using namespace std;
+
+namespace
+{
+	/* Loop state in the spirit of Google Benchmark: while (state.KeepRunning()) { ... } */
+	class State
+	{
+		public:
+			State(size_t iterations, int arg): arg(arg), left(iterations) {}
+			bool KeepRunning()
+			{
+				return left-- > 0;
+			}
+			const int arg;
+			size_t items = 0;
+
+		private:
+			size_t left;
+	};
+
+	struct Benchmark
+	{
+		string name;
+		std::function<void(State&)> fn;
+		int arg;
+	};
+
+	std::vector<Benchmark>& Registry()
+	{
+		static std::vector<Benchmark> benchmarks;
+		return benchmarks;
+	}
+
+	struct Registrar
+	{
+		Registrar(const string& name, std::function<void(State&)> fn, std::vector<int> args = { 0 })
+		{
+			for (auto i : args)
+			{
+				Registry().push_back({ args.size() > 1 || i ? name + "/" + std::to_string(i) : name, fn, i });
+			}
+		}
+	};
+
+	#define BENCHMARK(fn, ...) static Registrar registrar_##fn(#fn, fn, ##__VA_ARGS__)
+
+	template <class T>
+	void DoNotOptimize(const T& value)
+	{
+		asm volatile("" : : "r,m"(value) : "memory");
+	}
+
+	string fixtures = "bench/fixtures";
+
+	string ReadFile(const string& path)
+	{
+		std::ifstream in(path.c_str());
+		if (!in)
+		{
+			cerr << "Can not read " << path << endl;
+			exit(2);
+		}
+		std::stringstream ss;
+		ss << in.rdbuf();
+		return ss.str();
+	}
+
+	/* The fixture reply holds 10 domains, larger pages repeat them */
+	string SearchReply(int count)
+	{
+		static string reply = ReadFile(fixtures + "/search_domain_reply.xml");
+		auto begin = reply.find("<results><array>") + strlen("<results><array>");
+		auto end = reply.rfind("</array></results>");
+		string items = reply.substr(begin, end - begin), page;
+		for (int i = 0; i < count / 10; ++i)
+		{
+			page += items;
+		}
+		string ret = reply.substr(0, begin) + page + reply.substr(end);
+		auto total = ret.find("<total>10</total>");
+		return ret.replace(total, strlen("<total>10</total>"), "<total>" + std::to_string(count) + "</total>");
+	}
+
+	void BM_Transliterate(State& state)
+	{
+		string name = "Иванов Пётр Щукинович, ул. Большая Якиманка";
+		while (state.KeepRunning())
+		{
+			DoNotOptimize(processing::Transliterate(name));
+		}
+	}
+	BENCHMARK(BM_Transliterate);
+
+	void BM_AddPhone(State& state)
+	{
+		while (state.KeepRunning())
+		{
+			mgr_xml::Xml xml;
+			auto root = xml.GetRoot();
+			openprovider::AddPhone("+7 (495) 123-45-67", root);
+		}
+	}
+	BENCHMARK(BM_AddPhone);
+
+	void BM_AddAddress(State& state)
+	{
+		while (state.KeepRunning())
+		{
+			mgr_xml::Xml xml;
+			auto root = xml.GetRoot();
+			openprovider::AddAddress("Bolshaya Yakimanka 24", root);
+		}
+	}
+	BENCHMARK(BM_AddAddress);
+
+	void BM_SafeSubstr(State& state)
+	{
+		string passport = "4509123456";
+		while (state.KeepRunning())
+		{
+			DoNotOptimize(SafeSubstr(passport, 0, 5));
+			DoNotOptimize(SafeSubstr(passport, 5));
+		}
+	}
+	BENCHMARK(BM_SafeSubstr);
+
+	void BM_SplitDomain(State& state)
+	{
+		while (state.KeepRunning())
+		{
+			string tld = "moskva-cvety.com.ru", dom = str::GetWord(tld, '.');
+			DoNotOptimize(dom);
+			DoNotOptimize(tld);
+		}
+	}
+	BENCHMARK(BM_SplitDomain);
+
+	/* createCustomerRequest body as built by Remote_CreateDomainCustomer, without the DB lookups */
+	void BM_BuildCustomerRequest(State& state)
+	{
+		while (state.KeepRunning())
+		{
+			mgr_xml::Xml xml;
+			auto root = xml.SetRoot("openXML");
+			auto creds = root.AppendChild("credentials");
+			creds.AppendChild("username", "reseller");
+			creds.AppendChild("password", "secret");
+			auto r = root.AppendChild("createCustomerRequest");
+			auto address = r.AppendChild("address");
+			address.AppendChild("country", "RU");
+			address.AppendChild("state", "Moscow");
+			address.AppendChild("city", "Moscow");
+			address.AppendChild("zipcode", "119180");
+			openprovider::AddAddress("Bolshaya Yakimanka 24", address);
+			openprovider::AddName("Petr", "Ivanov", r);
+			openprovider::AddPhone("+7 (495) 123-45-67", r);
+			r.AppendChild("email", "petr@example.com");
+			DoNotOptimize(xml.Str());
+		}
+	}
+	BENCHMARK(BM_BuildCustomerRequest);
+
+	/* Reply text to DomainInfo records, as in every Import page */
+	void BM_ParseSearchDomain(State& state)
+	{
+		string reply = SearchReply(state.arg);
+		std::vector<openprovider::DomainInfo> ret;
+		int total;
+		while (state.KeepRunning())
+		{
+			mgr_xml::XmlString xml(reply);
+			openprovider::ParseSearchDomain(xml, ret, &total);
+			state.items += ret.size();
+		}
+	}
+	BENCHMARK(BM_ParseSearchDomain, { 100, 500, 1000 });
+
+	/* Runs a benchmark with doubling iteration counts until it takes at least 0.2s */
+	double Run(const Benchmark& bench, size_t& iterations, double& nsPerItem)
+	{
+		for (iterations = 1; ; iterations *= 2)
+		{
+			State state(iterations, bench.arg);
+			auto start = std::chrono::steady_clock::now();
+			bench.fn(state);
+			double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+			if (ns >= 2e8 || iterations >= (1u << 30))
+			{
+				nsPerItem = state.items ? ns / state.items : 0;
+				return ns / iterations;
+			}
+		}
+	}
+
+	string Option(const string& arg, const string& name)
+	{
+		return arg.compare(0, name.size() + 3, "--" + name + "=") == 0 ? arg.substr(name.size() + 3) : "";
+	}
+}
+
+int main(int argc, char** argv)
+{
+	string filter, save, baseline;
+	double tolerance = 25;
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i], value;
+		if (!(value = Option(arg, "filter")).empty())
+			filter = value;
+		else if (!(value = Option(arg, "fixtures")).empty())
+			fixtures = value;
+		else if (!(value = Option(arg, "save")).empty())
+			save = value;
+		else if (!(value = Option(arg, "baseline")).empty())
+			baseline = value;
+		else if (!(value = Option(arg, "tolerance")).empty())
+			tolerance = atof(value.c_str());
+		else
+		{
+			cerr << "Unknown option " << arg << endl;
+			return 2;
+		}
+	}
+
+	std::map<string, double> expected;
+	if (!baseline.empty())
+	{
+		std::ifstream in(baseline.c_str());
+		string name;
+		double ns;
+		while (in >> name >> ns)
+		{
+			expected[name] = ns;
+		}
+	}
+
+	int ret = 0;
+	std::ofstream out;
+	if (!save.empty())
+	{
+		out.open(save.c_str());
+	}
+	printf("%-32s %12s %14s %14s\n", "Benchmark", "Iterations", "ns/op", "ns/item");
+	for (auto &i : Registry())
+	{
+		if (!filter.empty() && i.name.find(filter) == string::npos)
+		{
+			continue;
+		}
+		size_t iterations;
+		double nsPerItem;
+		double ns = Run(i, iterations, nsPerItem);
+		printf("%-32s %12zu %14.1f %14.1f", i.name.c_str(), iterations, ns, nsPerItem);
+		auto it = expected.find(i.name);
+		if (it != expected.end() && ns > it->second * (1 + tolerance / 100))
+		{
+			printf("  REGRESSION (baseline %.1f)", it->second);
+			ret = 1;
+		}
+		printf("\n");
+		if (out)
+		{
+			out << i.name << " " << ns << "\n";
+		}
+	}
+	return ret;
+}
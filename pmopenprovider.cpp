@@ -6,15 +6,61 @@
 #include <processing/processingmodule.h>
 #include <processing/certificate_common.h>
 #include <processing/domain_common.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <fcntl.h>
+#include <cerrno>
+#include <sys/file.h>
+#include <unistd.h>
+#include "pmopenprovider_cache.h"
+#include "pmopenprovider_pool.h"
+#include "pmopenprovider_profile.h"
+#include "pmopenprovider_util.h"
+#include "pmopenprovider_zlib.h"
 
 using namespace processing;
 using namespace opts;
 using namespace std;
+using openprovider::AddAddress;
+using openprovider::AddName;
+using openprovider::AddNameServers;
+using openprovider::AddPhone;
+using openprovider::RenewYears;
+using openprovider::profile::Phase;
 
 #define BINARY_NAME "pmopenprovider"
 MODULE(BINARY_NAME);
 
 #define CERTIFICATE_ALTNAME "altname"
+#define CACHE_FILE "var/pmopenprovider.cache"
+#define IMPORT_HANDLE_CACHE 10000
+#define PROLONG_BULK_WORKERS 8
+#define PROLONG_BULK_RATE 5 /* renewals per second */
+#define PROLONG_BULK_BATCH 50 /* items per service.postprolong call */
+#define REGISTRY_EXPIREDATE "registry_expiredate"
+#define ITEM_LOCK_FILE "var/pmopenprovider_item.lock"
+#define TRANSFER_STARTED "transfer_started" /* unix time, empty once the transfer ended */
+#define TRANSFER_PAGE 100
+#define NS_GROUP_MEMBER "ns_group_member" /* item param: NS group the domain follows */
+#define NS_GROUP_MEMBER_SERVERS "ns_group_member_servers" /* item param: group nameservers it was last given */
+#define NS_GROUP_WORKERS 8 /* domains attached concurrently by sync_ns_group */
+#define COMPRESS_REQUEST_MIN 4096 /* bytes */
+#define CERT_SYNC_PAGE 100
+#define CHECK_DOMAIN_CHUNK 15 /* domains per checkDomainRequest */
+#define CHECK_DOMAIN_TTL 60 /* seconds */
+#define CHECK_CACHE_FILE "var/pmopenprovider_check.cache"
+#define CHECK_CACHE_SLOTS 16384
+#define CHECK_CACHE_SLOT 64 /* bytes, a slot holds one availability status */
+#define TRANSPORT_THREADS 64 /* most requests in flight per process, threads start on demand */
+#define PRICE_SYNC_PAGE 500
+#define CONTACT_SYNC_WORKERS 8
 
 namespace
 {
@@ -23,11 +69,339 @@ namespace
 		auto c = p ? p.FindNode(field) : p;
 		return c ? c.Str() : "";
 	}
+
+	/*
+	 * Parameterized statements: every "?" of the text is replaced by the next
+	 * escaped value, so no caller pastes raw values into SQL.
+	 * Lookup() additionally memoizes single values of reference tables.
+	 */
+	class Sql
+	{
+		public:
+			static mgr_db::QueryPtr Query(const string& text, const StringVector& args = StringVector())
+			{
+				auto db = sbin::DB();
+				string query;
+				size_t begin = 0, pos, arg = 0;
+				while ((pos = text.find('?', begin)) != string::npos)
+				{
+					if (arg == args.size())
+					{
+						throw mgr_err::Error("sql", "bind", text);
+					}
+					query += text.substr(begin, pos - begin) + db->EscapeValue(args[arg++]);
+					begin = pos + 1;
+				}
+				if (arg != args.size())
+				{
+					throw mgr_err::Error("sql", "bind", text);
+				}
+				return db->Query(query + text.substr(begin));
+			}
+
+			static string Lookup(const string& text, const StringVector& args)
+			{
+				string key = text;
+				for (auto &i : args)
+				{
+					key += '\0' + i;
+				}
+				{
+					std::lock_guard<std::mutex> guard(Lock());
+					auto it = Values().find(key);
+					if (it != Values().end())
+					{
+						return it->second;
+					}
+				}
+				string ret = Query(text, args)->Str();
+				std::lock_guard<std::mutex> guard(Lock());
+				Values()[key] = ret;
+				return ret;
+			}
+
+			/* "?, ?, ?" for an IN () list of n values */
+			static string Placeholders(size_t n)
+			{
+				string ret;
+				for (size_t i = 0; i < n; ++i)
+				{
+					ret += i ? ", ?" : "?";
+				}
+				return ret;
+			}
+
+		private:
+			static std::mutex& Lock()
+			{
+				static std::mutex lock;
+				return lock;
+			}
+			static StringMap& Values()
+			{
+				static StringMap values;
+				return values;
+			}
+	};
+
+	/* sbin::ClientQuery, accounted as a phase of its own */
+	auto BillingQuery(const string& query) -> decltype(sbin::ClientQuery(query))
+	{
+		Phase phase("ClientQuery");
+		return sbin::ClientQuery(query);
+	}
+
+	auto BillingQuery(const string& func, const StringMap& args) -> decltype(sbin::ClientQuery(func, args))
+	{
+		Phase phase("ClientQuery");
+		return sbin::ClientQuery(func, args);
+	}
+
+	/* Seconds a successful reply to a read-only request may be reused, 0 disables caching */
+	static int CacheTtl(const string& operation)
+	{
+		if (operation == "retrieveDomainRequest")
+			return 300;
+		if (operation == "retrieveCustomerRequest")
+			return 600;
+		if (operation == "searchProductSslCertRequest")
+			return 3600;
+		if (operation == "retrieveApproverEmailListSslCertRequest")
+			return 600;
+		return 0;
+	}
+
+	/* Name of the first request element following <credentials> */
+	static string RequestOperation(const string& request)
+	{
+		auto pos = request.find("</credentials>");
+		pos = request.find('<', pos == string::npos ? 0 : pos + 1);
+		if (pos == string::npos)
+			return "";
+		auto end = request.find_first_of(" />", pos + 1);
+		return request.substr(pos + 1, end == string::npos ? string::npos : end - pos - 1);
+	}
+
+	/*
+	 * Openprovider handle -> service_profile map shared by import workers.
+	 * Only the `capacity` most recently used handles are kept, evicted ones
+	 * are looked up in the database again.
+	 */
+	class HandleMemo
+	{
+		public:
+			explicit HandleMemo(size_t capacity): capacity(capacity) {}
+			bool Find(const string& handle, string& contact)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				auto it = index.find(handle);
+				if (it == index.end())
+					return false;
+				order.splice(order.begin(), order, it->second);
+				contact = it->second->second;
+				return true;
+			}
+			string Get(const string& handle)
+			{
+				string ret;
+				Find(handle, ret);
+				return ret;
+			}
+			StringMap Dump()
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				StringMap ret;
+				for (auto &i : order)
+				{
+					ret[i.first] = i.second;
+				}
+				return ret;
+			}
+			void Set(const string& handle, const string& contact)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				auto it = index.find(handle);
+				if (it != index.end())
+				{
+					it->second->second = contact;
+					order.splice(order.begin(), order, it->second);
+					return;
+				}
+				order.emplace_front(handle, contact);
+				index[handle] = order.begin();
+				if (index.size() > capacity)
+				{
+					index.erase(order.back().first);
+					order.pop_back();
+				}
+			}
+		private:
+			typedef std::list<std::pair<string, string>> List;
+			size_t capacity;
+			std::mutex lock;
+			List order;
+			std::unordered_map<string, List::iterator> index;
+	};
+
+	/* State files are written aside and renamed, so a crash never leaves a truncated one */
+	static void SaveState(const string& path, mgr_xml::Xml& xml)
+	{
+		string tmp = path + ".tmp";
+		{
+			std::ofstream out(tmp.c_str());
+			out << xml.Str(true);
+			if (!out)
+			{
+				throw mgr_err::Error("state", "write", path);
+			}
+		}
+		if (rename(tmp.c_str(), path.c_str()) != 0)
+		{
+			throw mgr_err::Error("state", "write", path);
+		}
+	}
+
+	static bool LoadState(const string& path, mgr_xml::Xml& xml)
+	{
+		if (access(path.c_str(), R_OK) != 0)
+		{
+			return false;
+		}
+		try
+		{
+			xml = mgr_xml::XmlFile(path);
+		}
+		catch (mgr_err::Error&)
+		{
+			Warning("Ignoring broken state file %s", path.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	/* Exclusive lock of a state file updated by several processes, held around load and save */
+	class StateLock
+	{
+		public:
+			explicit StateLock(const string& path)
+			{
+				string lockPath = path + ".lock";
+				fd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+				int res = -1;
+				while (fd >= 0 && (res = flock(fd, LOCK_EX)) != 0 && errno == EINTR)
+					;
+				if (res != 0)
+				{
+					if (fd >= 0)
+						close(fd);
+					throw mgr_err::Error("lock", "state", path);
+				}
+			}
+			~StateLock()
+			{
+				close(fd);
+			}
+			StateLock(const StateLock&) = delete;
+			StateLock& operator=(const StateLock&) = delete;
+		private:
+			int fd;
+	};
+
+	/*
+	 * Exclusive lock of one item across module processes and threads, held
+	 * while its registry state is read and renewed. Every item locks the byte
+	 * at offset iid of one shared empty file. Open file description locks are
+	 * used because they are owned by the descriptor, not by the process, so
+	 * threads exclude each other and closing one lock leaves the others held.
+	 */
+	class ItemLock
+	{
+		public:
+			explicit ItemLock(int iid)
+			{
+				fd = open(ITEM_LOCK_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+				struct flock range = {};
+				range.l_type = F_WRLCK;
+				range.l_whence = SEEK_SET;
+				range.l_start = iid;
+				range.l_len = 1;
+				int res = -1;
+				while (fd >= 0 && (res = fcntl(fd, F_OFD_SETLKW, &range)) != 0 && errno == EINTR)
+					;
+				if (res != 0)
+				{
+					if (fd >= 0)
+						close(fd);
+					throw mgr_err::Error("lock", "item", str::Str(iid));
+				}
+			}
+			~ItemLock()
+			{
+				close(fd);
+			}
+			ItemLock(const ItemLock&) = delete;
+			ItemLock& operator=(const ItemLock&) = delete;
+		private:
+			int fd;
+	};
+
+	/* Import progress of a module, saved after every committed page */
+	struct ImportCheckpoint
+	{
+		string search;
+		size_t part = 0;
+		int offset = 0;
+		int total = 1;
+		StringMap handles;
+
+		static string Path(int mid)
+		{
+			return "var/pmopenprovider_import_" + str::Str(mid) + ".xml";
+		}
+
+		bool Load(int mid)
+		{
+			mgr_xml::Xml xml;
+			if (!LoadState(Path(mid), xml))
+			{
+				return false;
+			}
+			auto root = xml.GetRoot();
+			search = root.GetProp("search");
+			part = str::Int(root.GetProp("part"));
+			offset = str::Int(root.GetProp("offset"));
+			total = str::Int(root.GetProp("total"));
+			for (auto i : xml.GetNodes("//handle"))
+			{
+				handles[i.GetProp("name")] = i.GetProp("contact");
+			}
+			return true;
+		}
+
+		void Save(int mid) const
+		{
+			mgr_xml::Xml xml;
+			auto root = xml.SetRoot("import");
+			root.SetProp("search", search)
+				.SetProp("part", str::Str(part))
+				.SetProp("offset", str::Str(offset))
+				.SetProp("total", str::Str(total));
+			for (auto &i : handles)
+			{
+				root.AppendChild("handle").SetProp("name", i.first).SetProp("contact", i.second);
+			}
+			SaveState(Path(mid), xml);
+		}
+
+		static void Remove(int mid)
+		{
+			unlink(Path(mid).c_str());
+		}
+	};
 }
 
 namespace processing
 {
-	string Transliterate(const string& arg);
 	struct SslTemplate
 	{
 		string id;
@@ -45,7 +419,7 @@ namespace processing
 	{
 		public:
 			struct OrderInfo { string crt, expire, status; };
-			struct DomainInfo { string domain; StringMap handles; StringVector ns; mgr_date::Date expire; };
+			typedef openprovider::DomainInfo DomainInfo;
 		private:
 			StringMap params;
 			string itemtype;
@@ -54,22 +428,40 @@ namespace processing
 			virtual void ProcessCommand();
 			void SetParam(const int iid);
 
+			string ModuleParam(const string& name);
 			mgr_xml::Xml Remote_GetOpenxml();
 			mgr_xml::Xml Remote_Send(mgr_xml::Xml req);
+			std::future<mgr_xml::Xml> Remote_SendAsync(mgr_xml::Xml req);
+			mgr_xml::Xml Remote_Exchange(const string& request);
+			string CacheKey(const string& request);
+			openprovider::SharedCache cache;
+			openprovider::SharedCache checkCache;
+			/* Declared after cache: its threads are joined before cache is destroyed */
+			openprovider::Executor transport;
 			std::vector<SslTemplate> Remote_SslTemplates();
 			StringVector Remote_SslApprovers(const string& domain, const string& cert);
 			string Remote_CreateCertCustomer(const string& prefix);
 			string Remote_CreateCert(bool doReissue = false);
+			mgr_xml::Xml Remote_GetCertQuery(const string& id);
+			OrderInfo Remote_GetCertParse(mgr_xml::Xml apiret);
 			OrderInfo Remote_GetCert(const string& id);
-			OrderInfo Remote_GetDomain(const string& id);
+			void DomainActivated(int iid, const OrderInfo& dom);
+			void CertificateIssued(int iid, const OrderInfo& crt);
+			mgr_xml::Xml Remote_GetDomainQuery(const string& domainName);
+			OrderInfo Remote_GetDomain(const string& id, bool fresh = false);
+			void Remote_DomainCustomerData(mgr_xml::XmlNode r, const string& prefix, bool modify);
 			string Remote_CreateDomainCustomer(const string& prefix);
-			void Remote_CreateDomain(const string& action);
-			std::vector<DomainInfo> Remote_SearchDomain(int limit, int offset, const StringMap &params, int *total = nullptr);
+			mgr_xml::Xml Remote_ModifyDomainCustomerQuery(const string& handle, const string& prefix);
+			mgr_xml::Xml Remote_GetCustomerQuery(const string& handle);
+			void Remote_CreateDomain(int iid, const string& action);
+			mgr_xml::Xml Remote_SearchDomainQuery(int limit, int offset, const StringMap &params);
 			void Remote_RenewDomain();
-			std::vector<std::string> DomainHandleTypes() { return { "owner", "admin", "bill", "tech" }; };
+			void Remote_RenewDomain(const string& domainName, int years);
+			std::vector<std::string> DomainHandleTypes() { return openprovider::DomainHandleTypes(); };
 			StringMap contact2handle;
 			void RegisterDomainContacts();
-			string StoreContact(const string& extid);
+			string StoreContact(const string& extid, mgr_xml::Xml apiret);
+			void ResolveHandles(const std::vector<DomainInfo>& domains, HandleMemo& handle2contact);
 
 		protected:
 			virtual int GetMaxTryCount(const std::string &operation);
@@ -77,7 +469,10 @@ namespace processing
 
 		public:
 			Openprovider():
-				Module(BINARY_NAME)
+				Module(BINARY_NAME),
+				cache(CACHE_FILE),
+				checkCache(CHECK_CACHE_FILE, CHECK_CACHE_SLOTS, CHECK_CACHE_SLOT),
+				transport(TRANSPORT_THREADS)
 			{
 			}
 			
@@ -100,105 +495,19 @@ namespace processing
 			mgr_xml::Xml GetContactType(const string& tld);
 			void UpdateNS(int) override;
 			void Import(const int mid, const string& itemtype, const string& search) override;
+			void ProlongBulk(int mid);
+			void SyncCertificates(int mid);
+			mgr_xml::Xml CheckDomains(int mid, const string& domains, const string& tlds);
+			mgr_xml::Xml SyncPrices(int mid);
+			mgr_xml::Xml SyncContacts(int mid);
+			void TrackTransfers(int mid);
+			StringVector NsGroupServers();
+			void SaveNsGroupMember(int iid, const string& group, const StringVector& servers);
+			void SyncNsGroup(int mid);
 			void Transfer(int iid, StringMap&);
 	};
 }
 
-static inline const wchar_t* TransliterateSymb(WCHAR c)
-{
-	switch (c)
-	{
-		case L'А': return L"A";
-		case L'Б': return L"B";
-		case L'В': return L"V";
-		case L'Г': return L"G";
-		case L'Д': return L"D";
-		case L'Е': return L"E";
-		case L'Ё': return L"Yo";
-		case L'Ж': return L"J";
-		case L'З': return L"Z";
-		case L'И': return L"I";
-		case L'Й': return L"J";
-		case L'К': return L"K";
-		case L'Л': return L"L";
-		case L'М': return L"M";
-		case L'Н': return L"N";
-		case L'О': return L"O";
-		case L'П': return L"P";
-		case L'Р': return L"R";
-		case L'С': return L"S";
-		case L'Т': return L"T";
-		case L'У': return L"U";
-		case L'Ф': return L"F";
-		case L'Х': return L"H";
-		case L'Ц': return L"Ts";
-		case L'Ч': return L"Ch";
-		case L'Ш': return L"Sh";
-		case L'Щ': return L"Sch";
-		case L'Ъ': return L"";
-		case L'Ы': return L"Y";
-		case L'Ь': return L"";
-		case L'Э': return L"E";
-		case L'Ю': return L"Yu";
-		case L'Я': return L"Ya";
-		case L'а': return L"a";
-		case L'б': return L"b";
-		case L'в': return L"v";
-		case L'г': return L"g";
-		case L'д': return L"d";
-		case L'е': return L"e";
-		case L'ё': return L"yo";
-		case L'ж': return L"j";
-		case L'з': return L"z";
-		case L'и': return L"i";
-		case L'й': return L"j";
-		case L'к': return L"k";
-		case L'л': return L"l";
-		case L'м': return L"m";
-		case L'н': return L"n";
-		case L'о': return L"o";
-		case L'п': return L"p";
-		case L'р': return L"r";
-		case L'с': return L"s";
-		case L'т': return L"t";
-		case L'у': return L"u";
-		case L'ф': return L"f";
-		case L'х': return L"h";
-		case L'ц': return L"ts";
-		case L'ч': return L"ch";
-		case L'ш': return L"sh";
-		case L'щ': return L"sch";
-		case L'ъ': return L"";
-		case L'ы': return L"y";
-		case L'ь': return L"";
-		case L'э': return L"e";
-		case L'ю': return L"yu";
-		case L'я': return L"ya";
-		default: return NULL;
-	}
-}
-
-string processing::Transliterate(const string& arg)
-{
-	str::u16string ret;
-	for (auto i : str::u16string(arg).operator str::u16string::base_type())
-	{
-		const wchar_t *j = TransliterateSymb(i);
-		if (!j)
-		{
-			ret.push_back(i);
-		}
-		else
-		{
-			while (*j)
-			{
-				ret.push_back(*j++);
-			}
-		}
-	}
-	return str::u16string(ret);
-}
-
 void Openprovider::ProcessCommand()
 {
 	auto c_m_args = m_args.get();
@@ -227,6 +536,34 @@ void Openprovider::ProcessCommand()
 	{
 		UpdateNS(str::Int(c_m_args->Item));
 	}
+	else if (cmd == "check_domain")
+	{
+		std::cout << CheckDomains(str::Int(c_m_args->Module), c_m_args->Domain.AsString(), c_m_args->Tld.AsString()).Str(true);
+	}
+	else if (cmd == "sync_prices")
+	{
+		std::cout << SyncPrices(str::Int(c_m_args->Module)).Str(true);
+	}
+	else if (cmd == "sync_contacts")
+	{
+		std::cout << SyncContacts(str::Int(c_m_args->Module)).Str(true);
+	}
+	else if (cmd == "track_transfers")
+	{
+		TrackTransfers(str::Int(c_m_args->Module));
+	}
+	else if (cmd == "sync_ns_group")
+	{
+		SyncNsGroup(str::Int(c_m_args->Module));
+	}
+	else if (cmd == "sync_certificates")
+	{
+		SyncCertificates(str::Int(c_m_args->Module));
+	}
+	else if (cmd == "prolong_bulk")
+	{
+		ProlongBulk(str::Int(c_m_args->Module));
+	}
 	else if (cmd == "import")
 	{
 		Import(str::Int(c_m_args->Module), c_m_args->ItemType, c_m_args->ImportSearchString);
@@ -266,7 +603,7 @@ int Openprovider::GetMaxTryCount(const std::string &operation)
 
 void Openprovider::InternalAddItemParam(StringMap &params, const int iid)
 {
-	mgr_db::QueryPtr param = sbin::DB()->Query("SELECT pkey, csr, crt FROM certificate WHERE item = " + str::Str(iid));
+	mgr_db::QueryPtr param = Sql::Query("SELECT pkey, csr, crt FROM certificate WHERE item = ?", { str::Str(iid) });
 	if (!param->Eof())
 	{
 		params["key"] = param->AsString("pkey");
@@ -277,7 +614,14 @@ void Openprovider::InternalAddItemParam(StringMap &params, const int iid)
 
 void Openprovider::SetParam(const int iid)
 {
-	sbin::ClientQuery("func=service.postsetparam&sok=ok&elid=" + str::Str(iid));
+	BillingQuery("func=service.postsetparam&sok=ok&elid=" + str::Str(iid));
+}
+
+/* Read-only lookup: operator[] would insert and race with other transport threads */
+string Openprovider::ModuleParam(const string& name)
+{
+	auto it = m_module_data.find(name);
+	return it == m_module_data.end() ? "" : it->second;
 }
 
 mgr_xml::Xml Openprovider::Remote_GetOpenxml()
@@ -285,24 +629,91 @@ mgr_xml::Xml Openprovider::Remote_GetOpenxml()
 	mgr_xml::Xml xml;
 	auto root = xml.SetRoot("openXML");
 	auto creds = root.AppendChild("credentials");
-	creds.AppendChild("username", m_module_data["login"]);
-	creds.AppendChild("password", m_module_data["password"]);
+	creds.AppendChild("username", ModuleParam("login"));
+	creds.AppendChild("password", ModuleParam("password"));
 	return xml;
 }
 
+string Openprovider::CacheKey(const string& request)
+{
+	/* The password is left out: a key is the account plus the request body */
+	string key = request;
+	auto begin = key.find("<credentials>");
+	auto end = key.find("</credentials>");
+	if (begin != string::npos && end != string::npos)
+	{
+		key.replace(begin, end + strlen("</credentials>") - begin, ModuleParam("login"));
+	}
+	return ModuleParam("url") + "\n" + key;
+}
+
 mgr_xml::Xml Openprovider::Remote_Send(mgr_xml::Xml req)
 {
-	string request = req.Str();
+	return Remote_SendAsync(req).get();
+}
+
+std::future<mgr_xml::Xml> Openprovider::Remote_SendAsync(mgr_xml::Xml req)
+{
+	string request;
+	{
+		Phase phase("build");
+		request = req.Str();
+	}
+	return transport.Submit([this, request]() -> mgr_xml::Xml
+	{
+		return Remote_Exchange(request);
+	});
+}
+
+mgr_xml::Xml Openprovider::Remote_Exchange(const string& request)
+{
+	string key;
+	int ttl = CacheTtl(RequestOperation(request));
+	if (ttl)
+	{
+		key = CacheKey(request);
+		string cached;
+		if (cache.Get(key, cached))
+		{
+			LogExtInfo("Cached response:\n%s\n", cached.c_str());
+			return mgr_xml::XmlString(cached);
+		}
+	}
 	LogExtInfo("Sending request:\n%s\n", request.c_str());
 
 	mgr_rpc::HttpQuery http;
 	http.AcceptAnyResponse();
 	http.AddHeader("Content-Type: text/xml");
-	
+	http.AddHeader("Accept-Encoding: gzip, deflate");
+
+	string body;
+	if (request.size() < COMPRESS_REQUEST_MIN || ModuleParam("compress_requests") != "on" ||
+		!openprovider::Gzip(request, body))
+	{
+		body = request;
+	}
+	else
+	{
+		http.AddHeader("Content-Encoding: gzip");
+	}
+
 	std::stringstream ss;
-	http.Post(m_module_data["url"], request, ss);
-	
-	mgr_xml::XmlString ret(ss.str());
+	{
+		Phase phase("send");
+		openprovider::InflateBuf inflate(ss);
+		std::ostream out(&inflate);
+		http.Post(ModuleParam("url"), body, out);
+		if (!inflate.Finish())
+		{
+			throw mgr_err::Error("remote", "bad_encoding");
+		}
+	}
+
+	mgr_xml::Xml ret;
+	{
+		Phase phase("parse");
+		ret = mgr_xml::XmlString(ss.str());
+	}
 	LogExtInfo("Response:\n%s\n", ss.str().c_str());
 
 	auto reply = ret.GetNode("//reply");
@@ -319,6 +730,10 @@ mgr_xml::Xml Openprovider::Remote_Send(mgr_xml::Xml req)
 		}
 		throw mgr_err::Error("remote", "bad_code", desc);
 	}
+	if (ttl)
+	{
+		cache.Put(key, ss.str(), ttl);
+	}
 	return ret;
 }
 
@@ -351,7 +766,7 @@ std::vector<SslTemplate> Openprovider::Remote_SslTemplates()
 		{
 			cur.multidomain = true;
 		}
-		ret.push_back(cur);
+		ret.push_back(std::move(cur));
 	}
 	return ret;
 }
@@ -373,80 +788,135 @@ StringVector Openprovider::Remote_SslApprovers(const string& domain, const strin
 
 namespace
 {
-	static void AddPhone(string phone, mgr_xml::XmlNode& r)
-	{
-		StringVector ret;
-		if (!phone.size() || phone[0] != '+')
-		{
-			phone = "+" + phone;
-		}
-		str::inpl::Replace(phone, "(", "");
-		str::inpl::Replace(phone, ")", "");
-		str::inpl::Replace(phone, "-", "");
-		str::Split(phone, ret, " ");
-		if (ret.size() != 3)
-		{
-			ret.clear();
-			str::inpl::Replace(phone, " ", "");
-			ret.push_back(phone.substr(0, 2));
-			ret.push_back(phone.substr(2, 3));
-			ret.push_back(phone.substr(5));
-		}
-
-		auto &phoneList = ret;
-		auto phoneNode = r.AppendChild("phone");
-		phoneNode.AppendChild("countryCode", phoneList[0]);
-		phoneNode.AppendChild("areaCode", phoneList[1]);
-		phoneNode.AppendChild("subscriberNumber", phoneList[2]);
-	}
-
 	string CountryCode(const string& id)
 	{
-		return sbin::DB()->Query("SELECT iso2 FROM country WHERE id='" + id + "' LIMIT 1")->Str();
+		return Sql::Lookup("SELECT iso2 FROM country WHERE id = ? LIMIT 1", { id });
 	}
 
 	string CountryNameRu(const string& id)
 	{
-		return sbin::DB()->Query("SELECT name_ru FROM country WHERE id='" + id + "' LIMIT 1")->Str();
+		return Sql::Lookup("SELECT name_ru FROM country WHERE id = ? LIMIT 1", { id });
 	}
 
 	string CountryCodeRev(const string& code)
 	{
-		return sbin::DB()->Query("SELECT id FROM country WHERE iso2='" + code + "' LIMIT 1")->Str();
+		return Sql::Lookup("SELECT id FROM country WHERE iso2 = ? LIMIT 1", { code });
 	}
 
-	static void AddAddress(const string& address1, mgr_xml::XmlNode& address)
+	/* Nameservers without duplicates and case differences, for comparison */
+	/* Nameserver names without glue addresses, for comparing lists in any order */
+	std::set<string> NameServerSet(const StringVector& ns)
 	{
-		string address0 = address1, number;
-		while (!address0.empty() && isdigit(*address0.rbegin()))
+		std::set<string> ret;
+		for (auto &i : ns)
 		{
-			number = *address0.rbegin() + number;
-			address0.resize(address0.size() - 1);
+			ret.insert(str::Lower(i.substr(0, i.find('/'))));
 		}
-		if (number.empty())
+		return ret;
+	}
+
+	StringVector SplitNameServers(const string& list)
+	{
+		StringVector ret;
+		str::Split(list, " ", ret);
+		ret.erase(std::remove(ret.begin(), ret.end(), ""), ret.end());
+		return ret;
+	}
+
+	string JoinNameServers(const StringVector& ns)
+	{
+		string ret;
+		for (auto &i : ns)
 		{
-			number = "1";
+			ret += (ret.empty() ? "" : " ") + i;
 		}
-		address.AppendChild("street", address0);
-		address.AppendChild("number", number);
+		return ret;
 	}
 
-	static void AddName(const string& fname, const string& lname, mgr_xml::XmlNode &r)
+	/* Name below the longest known public suffix: www.shop.example.com.ru -> example.com.ru */
+	string RegistrableDomain(const string& name)
 	{
-		auto name = r.AppendChild("name");
-		name.AppendChild("firstName", fname);
-		name.AppendChild("lastName", lname);
-		if (!fname.empty() && !lname.empty())
+		string host = name.compare(0, 2, "*.") == 0 ? name.substr(2) : name;
+		StringVector labels;
+		str::Split(host, ".", labels);
+		for (size_t i = 1; i + 1 < labels.size(); ++i)
+		{
+			string suffix;
+			for (size_t j = i; j < labels.size(); ++j)
+			{
+				suffix += (suffix.empty() ? "" : ".") + labels[j];
+			}
+			if (!Sql::Lookup("SELECT id FROM tld WHERE name = ?", { suffix }).empty())
+			{
+				return labels[i - 1] + "." + suffix;
+			}
+		}
+		if (labels.size() < 2)
 		{
-			name.AppendChild("initials", fname[0] + string(".") + lname[0] + ".");
+			return host;
 		}
-		r.AppendChild("gender", "M");
+		return labels[labels.size() - 2] + "." + labels.back();
 	}
 
 	static string GetDomainZoneCode(const string& domain)
 	{
 		string tld = domain, dom = str::GetWord(tld, '.');
-		return sbin::DB()->Query("SELECT id FROM tld WHERE name='" + tld + "'")->Str();
+		return Sql::Lookup("SELECT id FROM tld WHERE name = ?", { tld });
+	}
+
+	/* Content hash of a service profile as last sent to Openprovider */
+	string ProfileHash(const string& profiletype, const std::map<string, string>& values)
+	{
+		string data = profiletype;
+		for (auto &i : values)
+		{
+			data += "\n" + i.first + "=" + i.second;
+		}
+		char buf[17];
+		snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(openprovider::SharedCache::Hash(data)));
+		return buf;
+	}
+
+	/* Handle -> profile hash of the handles of one module, as last sent to Openprovider */
+	string ContactStatePath(int mid)
+	{
+		return "var/pmopenprovider_contacts_" + str::Str(mid) + ".xml";
+	}
+
+	StringMap LoadContactHashes(int mid)
+	{
+		StringMap ret;
+		mgr_xml::Xml xml;
+		if (LoadState(ContactStatePath(mid), xml))
+		{
+			for (auto i : xml.GetNodes("//contact"))
+			{
+				ret[i.GetProp("handle")] = i.GetProp("hash");
+			}
+		}
+		return ret;
+	}
+
+	/* Merged into the stored hashes under a lock, Open() and sync_contacts may save at once */
+	void SaveContactHashes(int mid, const StringMap& handle2hash)
+	{
+		if (handle2hash.empty())
+		{
+			return;
+		}
+		StateLock lock(ContactStatePath(mid));
+		auto stored = LoadContactHashes(mid);
+		for (auto &i : handle2hash)
+		{
+			stored[i.first] = i.second;
+		}
+		mgr_xml::Xml xml;
+		auto root = xml.SetRoot("contacts");
+		for (auto &i : stored)
+		{
+			root.AppendChild("contact").SetProp("handle", i.first).SetProp("hash", i.second);
+		}
+		SaveState(ContactStatePath(mid), xml);
 	}
 }
 
@@ -501,12 +971,21 @@ string Openprovider::Remote_CreateCert(bool doReissue)
 	return apiret.GetNode("//reply/data/id").Str();
 }
 
-Openprovider::OrderInfo Openprovider::Remote_GetCert(const string& id)
+mgr_xml::Xml Openprovider::Remote_GetCertQuery(const string& id)
 {
 	auto q = Remote_GetOpenxml();
 	auto r = q.GetRoot().AppendChild("retrieveOrderSslCertRequest");
 	r.AppendChild("id", id);
-	auto apiret = Remote_Send(q);
+	return q;
+}
+
+Openprovider::OrderInfo Openprovider::Remote_GetCert(const string& id)
+{
+	return Remote_GetCertParse(Remote_Send(Remote_GetCertQuery(id)));
+}
+
+Openprovider::OrderInfo Openprovider::Remote_GetCertParse(mgr_xml::Xml apiret)
+{
 	auto data = apiret.GetNode("//reply/data");
 	OrderInfo ret;
 	ret.status = data.FindNode("status").Str();
@@ -519,7 +998,7 @@ Openprovider::OrderInfo Openprovider::Remote_GetCert(const string& id)
 	return ret;
 }
 
-Openprovider::OrderInfo Openprovider::Remote_GetDomain(const string& domainName)
+mgr_xml::Xml Openprovider::Remote_GetDomainQuery(const string& domainName)
 {
 	auto q = Remote_GetOpenxml();
 	auto r = q.GetRoot().AppendChild("retrieveDomainRequest");
@@ -527,6 +1006,16 @@ Openprovider::OrderInfo Openprovider::Remote_GetDomain(const string& domainName)
 	string tld = domainName, dom = str::GetWord(tld, '.');
 	domain.AppendChild("name", dom);
 	domain.AppendChild("extension", tld);
+	return q;
+}
+
+Openprovider::OrderInfo Openprovider::Remote_GetDomain(const string& domainName, bool fresh)
+{
+	auto q = Remote_GetDomainQuery(domainName);
+	if (fresh)
+	{
+		cache.Erase(CacheKey(q.Str()));
+	}
 	auto apiret = Remote_Send(q);
 	auto data = apiret.GetNode("//reply/data");
 	OrderInfo ret;
@@ -539,15 +1028,11 @@ Openprovider::OrderInfo Openprovider::Remote_GetDomain(const string& domainName)
 	return ret;
 }
 
-string SafeSubstr(const string &s, size_t begin, size_t end = string::npos) {
-	return s.size() > begin ? s.substr(begin, end) : string();
-}
-
-string Openprovider::Remote_CreateDomainCustomer(const string& prefix)
+/* Customer fields of a create or modify request, names can not be modified */
+void Openprovider::Remote_DomainCustomerData(mgr_xml::XmlNode r, const string& prefix, bool modify)
 {
-	auto q = Remote_GetOpenxml();
-	auto r = q.GetRoot().AppendChild("createCustomerRequest");
-	if (params[prefix + "_company"] != "")
+	Phase phase("build");
+	if (!modify && params[prefix + "_company"] != "")
 	{
 		r.AppendChild("companyName", params[prefix + "_company"]);
 	}
@@ -557,7 +1042,10 @@ string Openprovider::Remote_CreateDomainCustomer(const string& prefix)
 	address.AppendChild("city", params[prefix + "_location_city"]);
 	address.AppendChild("zipcode", params[prefix + "_location_postcode"]);
 	AddAddress(params[prefix + "_location_address"], address);
-	AddName(params[prefix + "_firstname"], params[prefix + "_lastname"], r);
+	if (!modify)
+	{
+		AddName(params[prefix + "_firstname"], params[prefix + "_lastname"], r);
+	}
 	AddPhone(params[prefix + "_phone"], r);
 	r.AppendChild("email", params[prefix + "_email"]);
 	if (!params[prefix + "_birthdate"].empty() || !params[prefix + "_passport"].empty())
@@ -607,25 +1095,54 @@ string Openprovider::Remote_CreateDomainCustomer(const string& prefix)
 			" " + params[prefix + "_location_city_ru"] +
 			" " + params[prefix + "_location_address_ru"]);
 	}
+}
+
+string Openprovider::Remote_CreateDomainCustomer(const string& prefix)
+{
+	auto q = Remote_GetOpenxml();
+	Remote_DomainCustomerData(q.GetRoot().AppendChild("createCustomerRequest"), prefix, false);
 	auto apiret = Remote_Send(q);
 	return apiret.GetNode("//reply/data/handle").Str();
 }
 
+mgr_xml::Xml Openprovider::Remote_ModifyDomainCustomerQuery(const string& handle, const string& prefix)
+{
+	auto q = Remote_GetOpenxml();
+	auto r = q.GetRoot().AppendChild("modifyCustomerRequest");
+	r.AppendChild("handle", handle);
+	Remote_DomainCustomerData(r, prefix, true);
+	return q;
+}
+
+mgr_xml::Xml Openprovider::Remote_GetCustomerQuery(const string& handle)
+{
+	auto q = Remote_GetOpenxml();
+	auto r = q.GetRoot().AppendChild("retrieveCustomerRequest");
+	r.AppendChild("handle", handle);
+	r.AppendChild("withAdditionalData", "true");
+	return q;
+}
+
 void Openprovider::Remote_RenewDomain()
 {
-	StringVector ret;
+	Remote_RenewDomain(params["domain"], str::Int(params["period"]) / 12);
+}
+
+void Openprovider::Remote_RenewDomain(const string& domainName, int years)
+{
 	auto q = Remote_GetOpenxml();
 	auto r = q.GetRoot().AppendChild("renewDomainRequest");
 	auto domain = r.AppendChild("domain");
-	string tld = params["domain"], dom;
+	string tld = domainName, dom;
 	dom = str::GetWord(tld, '.');
 	domain.AppendChild("name", dom);
 	domain.AppendChild("extension", tld);
-	r.AppendChild("period", str::Str(str::Int(params["period"]) / 12));
+	r.AppendChild("period", str::Str(years));
 	Remote_Send(q);
+	cache.Erase(CacheKey(Remote_GetDomainQuery(domainName).Str()));
 }
 
-void Openprovider::Remote_CreateDomain(const string& action)
+void Openprovider::Remote_CreateDomain(int iid, const string& action)
 {
 	auto q = Remote_GetOpenxml();
 	auto r = q.GetRoot().AppendChild((action + "DomainRequest").c_str());
@@ -704,91 +1221,54 @@ void Openprovider::Remote_CreateDomain(const string& action)
 			ns.emplace_back(i);
 		}
 	}
-	if (ns.empty())
+	/*
+	 * Domains on the module's nameservers follow its NS group, so they move
+	 * with it. A member whose nameservers are still the ones it was last given
+	 * stays in the group even if the group has moved on since.
+	 */
+	string group = ModuleParam("ns_group");
+	auto groupServers = NsGroupServers();
+	bool member = !group.empty() && params[NS_GROUP_MEMBER] == group;
+	bool join = !group.empty() && (ns.empty() || NameServerSet(ns) == NameServerSet(groupServers) ||
+		(member && NameServerSet(ns) == NameServerSet(SplitNameServers(params[NS_GROUP_MEMBER_SERVERS]))));
+	if (join)
 	{
-		ns = { "ina1.registrar.eu", "ina2.registrar.eu", "ina3.registrar.eu" };
+		r.AppendChild("nsGroup", group);
 	}
-	auto nservers = r.AppendChild("nameServers");
-	auto array = nservers.AppendChild("array");
-	for (auto i : ns)
+	else
 	{
-		auto item = array.AppendChild("item");
-		StringVector parts;
-		str::Split(i, "/", parts);
-		if (parts.size() == 0)
-		{
-			continue;
-		}
-		item.AppendChild("name", parts[0]);
-		if (parts.size() == 2)
+		if (ns.empty())
 		{
-			item.AppendChild("ip", parts[1]);
+			ns = { "ina1.registrar.eu", "ina2.registrar.eu", "ina3.registrar.eu" };
 		}
+		AddNameServers(ns, r);
 	}
 	Remote_Send(q);
+	if (join && (!member || params[NS_GROUP_MEMBER_SERVERS] != JoinNameServers(groupServers)))
+	{
+		SaveNsGroupMember(iid, group, groupServers);
+	}
+	else if (!join && !params[NS_GROUP_MEMBER].empty())
+	{
+		SaveParam(iid, NS_GROUP_MEMBER, "");
+		SaveParam(iid, NS_GROUP_MEMBER_SERVERS, "");
+	}
+	cache.Erase(CacheKey(Remote_GetDomainQuery(params["domain"]).Str()));
 }
 
-std::vector<Openprovider::DomainInfo> Openprovider::Remote_SearchDomain(int limit, int offset, const StringMap &params, int* total)
+mgr_xml::Xml Openprovider::Remote_SearchDomainQuery(int limit, int offset, const StringMap &params)
 {
 	auto q = Remote_GetOpenxml();
 	auto r = q.GetRoot().AppendChild("searchDomainRequest");
 	r.AppendChild("limit", str::Str(limit));
 	r.AppendChild("offset", str::Str(offset));
-	for (auto i : { "extension", "domainNamePattern", "contactHandle", "nsGroupPattern", "status" })
+	for (auto i : { "extension", "domainNamePattern", "contactHandle", "nsGroupPattern", "status", "expirationDateFrom", "expirationDateTo" })
 	{
 		auto it = params.find(i);
 		if (it != params.end())
 			r.AppendChild(i, it->second);
 	}
-	auto apiret = Remote_Send(q);
-	auto data = apiret.GetNode("//reply/data");
-	if (total)
-	{
-		*total = str::Int(data.FindNode("total").Str());
-	}
-
-	std::vector<DomainInfo> ret;
-	for (auto i : apiret.GetNodes("//reply/data/results/array/item"))
-	{
-		Debug("prep");
-		DomainInfo cur;
-		auto domNode = i.FindNode("domain");
-		cur.domain = domNode.FindNode("name").Str() + "." + domNode.FindNode("extension").Str();
-		Debug("dom %s", cur.domain.c_str());
-		for (auto j : DomainHandleTypes())
-		{
-			Debug("Getting contact %s", j.c_str());
-			string handle = i.FindNode((j == "bill" ? "billing" : j) + "Handle").Str();
-			if (handle != "")
-			{
-				cur.handles[j] = handle;
-			}
-		}
-		auto nsNode = i.FindNode("nameServers");
-
-		if (nsNode)
-		{
-			auto arr = nsNode.FindNode("array");
-			for (auto j = arr.FirstChild(); j; j = j.Next())
-			{
-				/* j = <item> */
-				cur.ns.push_back(j.FindNode("name").Str());
-			}
-		}
-		Debug("Getting exp");
-		string exp = i.FindNode("expirationDate").Str();
-		try
-		{
-			cur.expire = mgr_date::Date(str::GetWord(exp, ' '));
-		}
-		catch (mgr_err::Error&)
-		{
-			cur.expire = mgr_date::Date(static_cast<time_t>(0));
-		}
-		ret.push_back(cur);
-		Debug("Got exp");
-	}
-	return ret;
+	return q;
 }
 
 mgr_xml::Xml Openprovider::Features()
@@ -801,6 +1281,10 @@ mgr_xml::Xml Openprovider::Features()
 	params.AppendChild("param").SetProp("name", "url");
 	params.AppendChild("param").SetProp("name", "login");
 	params.AppendChild("param").SetProp("name", "password").SetProp("crypted", "yes");
+	params.AppendChild("param").SetProp("name", "compress_requests");
+	params.AppendChild("param").SetProp("name", "ns_group");
+	params.AppendChild("param").SetProp("name", "ns_group_servers");
+	params.AppendChild("param").SetProp("name", "price_markup");
 	auto features = xml.GetRoot().AppendChild("features");
 	features.AppendChild("feature").SetProp("name", PROCESSING_CERTIFICATE_APPROVER);
 	features.AppendChild("feature").SetProp("name", PROCESSING_PROLONG);
@@ -809,21 +1293,26 @@ mgr_xml::Xml Openprovider::Features()
 	features.AppendChild("feature").SetProp("name", "get_contact_type");
 	features.AppendChild("feature").SetProp("name", "update_ns");
 	features.AppendChild("feature").SetProp("name", "import");
+	features.AppendChild("feature").SetProp("name", "prolong_bulk");
+	features.AppendChild("feature").SetProp("name", "sync_certificates");
+	features.AppendChild("feature").SetProp("name", "check_domain");
+	features.AppendChild("feature").SetProp("name", "sync_prices");
+	features.AppendChild("feature").SetProp("name", "sync_contacts");
+	features.AppendChild("feature").SetProp("name", "track_transfers");
+	features.AppendChild("feature").SetProp("name", "sync_ns_group");
 	xml.GetRoot().AppendChild(mgr_xml::XmlFile("etc/openprovider_ssltemplates.xml").GetRoot());
 	return xml;
 }
 
 void Openprovider::CheckParam(mgr_xml::Xml item_xml, const int item_id, const string& param_name, const string& value)
 {
+	/* Nothing is validated, so the item is not loaded either */
 	Debug("check_param name=%s value=%s", param_name.c_str(), value.c_str());
-	if (item_id)
-	{
-		Init(item_id);
-	}
 }
 
 void Openprovider::Init(int iid)
 {
+	Phase phase("Init");
 	Debug("init id=%d", iid);
 	auto item_query = ItemQuery(iid);
 	for (size_t i = 0; i < item_query->ColCount(); ++i)
@@ -848,16 +1337,16 @@ void Openprovider::Init(int iid)
 	}
 	else if (itemtype == "domain")
 	{
-		ForEachQuery(sbin::DB(),
+		for (auto i = Sql::Query(
 			"SELECT sp2i.type, sp2i.service_profile, externalid, sp.profiletype "
 			"FROM service_profile2item sp2i "
 			"LEFT JOIN service_profile2processingmodule sp2pm "
 			"ON sp2pm.service_profile = sp2i.service_profile "
-			"AND sp2pm.processingmodule = " + params["processingmodule"] + " " 
-			" JOIN service_profile sp ON sp.id = sp2i.service_profile "
-			"WHERE item = " + str::Str(iid), i)
+			"AND sp2pm.processingmodule = ? "
+			"JOIN service_profile sp ON sp.id = sp2i.service_profile "
+			"WHERE item = ?", { params["processingmodule"], str::Str(iid) }); !i->Eof(); i->Next())
 		{
-			ForEachQuery(sbin::DB(),"SELECT intname, value FROM service_profileparam WHERE service_profile=" + i->AsString(1), j)
+			for (auto j = Sql::Query("SELECT intname, value FROM service_profileparam WHERE service_profile = ?", { i->AsString(1) }); !j->Eof(); j->Next())
 			{
 				params[i->AsString(0) + "_" + j->AsString(0)] = Transliterate(j->AsString(1));
 				params[i->AsString(0) + "_" + j->AsString(0) + "_ru"] = j->AsString(1);
@@ -883,14 +1372,14 @@ void Openprovider::Open(int iid)
 		params[SERVICE_ORDER_ID] = Remote_CreateCert();
 		SaveParam(iid, SERVICE_ORDER_ID, params[SERVICE_ORDER_ID]);
 		SetServiceStatus(iid, 3 /* Cert is requested */);
-		sbin::ClientQuery("func=service.postopen&sok=ok&elid=" + str::Str(iid));
+		BillingQuery("func=service.postopen&sok=ok&elid=" + str::Str(iid));
 	}
 	else if (itemtype == "domain")
 	{
 		RegisterDomainContacts();
-		Remote_CreateDomain("create");
+		Remote_CreateDomain(iid, "create");
 		SyncItem(iid);
-		sbin::ClientQuery("func=service.postopen&sok=ok&elid=" + str::Str(iid));
+		BillingQuery("func=service.postopen&sok=ok&elid=" + str::Str(iid));
 	}
 }
 
@@ -903,9 +1392,33 @@ void Openprovider::Prolong(int iid)
 	}
 	else if (itemtype == "domain")
 	{
-		Remote_RenewDomain();
+		/*
+		 * Billing has already moved expiredate to the paid date. Only the years
+		 * the registry still lacks are renewed, so an item renewed by
+		 * prolong_bulk or by an earlier attempt is not renewed again.
+		 */
+		ItemLock lock(iid);
+		string paid = Sql::Query("SELECT expiredate FROM item WHERE id = ?", { str::Str(iid) })->Str();
+		auto dom = Remote_GetDomain(params["domain"], true);
+		if (dom.status != "ACT")
+		{
+			Remote_RenewDomain();
+		}
+		else if (int years = RenewYears(dom.expire, paid))
+		{
+			Remote_RenewDomain(params["domain"], years);
+			dom = Remote_GetDomain(params["domain"], true);
+		}
+		else
+		{
+			Debug("Domain %s already covers %s", params["domain"].c_str(), paid.c_str());
+		}
+		if (!dom.expire.empty())
+		{
+			SaveParam(iid, REGISTRY_EXPIREDATE, dom.expire);
+		}
 	}
-	sbin::ClientQuery("func=service.postprolong&sok=ok&elid=" + str::Str(iid));
+	BillingQuery("func=service.postprolong&sok=ok&elid=" + str::Str(iid));
 }
 
 void Openprovider::Reopen(int iid)
@@ -920,27 +1433,66 @@ void Openprovider::Reopen(int iid)
 
 void Openprovider::Resume(int iid)
 {
-	sbin::ClientQuery("func=service.postresume&sok=ok&elid=" + str::Str(iid));
+	BillingQuery("func=service.postresume&sok=ok&elid=" + str::Str(iid));
 }
 
 void Openprovider::Suspend(int iid)
 {
-	sbin::ClientQuery("func=service.postsuspend&sok=ok&elid=" + str::Str(iid));
+	BillingQuery("func=service.postsuspend&sok=ok&elid=" + str::Str(iid));
 }
 
 void Openprovider::Close(int iid)
 {
-	sbin::ClientQuery("func=service.postclose&sok=ok&elid=" + str::Str(iid));
+	BillingQuery("func=service.postclose&sok=ok&elid=" + str::Str(iid));
 }
 
+/*
+ * Approver emails of one domain or of a space-separated list of names, as
+ * passed for multi-domain certificates. Names sharing a registrable domain
+ * are looked up once, distinct ones concurrently.
+ */
 mgr_xml::Xml Openprovider::ApproverList(const int mid, const string& domain, const string& intname)
 {
 	SetModule(mid);
+	StringVector names;
+	str::Split(domain, " ", names);
+	string cert = intname.substr(3);
+
+	std::map<string, std::future<StringVector>> lookups;
+	StringMap registrable;
+	for (auto &i : names)
+	{
+		string name = str::Trim(i);
+		if (name.empty() || registrable.count(name))
+		{
+			continue;
+		}
+		registrable[name] = names.size() == 1 ? name : RegistrableDomain(name);
+		string key = registrable[name];
+		if (!lookups.count(key))
+		{
+			lookups[key] = transport.Submit([this, key, cert]() { return Remote_SslApprovers(key, cert); });
+		}
+	}
+
+	std::map<string, StringVector> approvers;
+	for (auto &i : lookups)
+	{
+		approvers[i.first] = i.second.get();
+	}
 	mgr_xml::Xml approver;
-	auto node = approver.GetRoot().AppendChild("domain").SetProp("name", domain);
-	for (auto i : Remote_SslApprovers(domain, intname.substr(3)))
+	for (auto &i : names)
 	{
-		node.AppendChild("approver", i);
+		string name = str::Trim(i);
+		if (name.empty())
+		{
+			continue;
+		}
+		auto node = approver.GetRoot().AppendChild("domain").SetProp("name", name);
+		for (auto &j : approvers[registrable[name]])
+		{
+			node.AppendChild("approver", j);
+		}
 	}
 	return approver;
 }
@@ -955,10 +1507,7 @@ void Openprovider::SyncItem(int iid)
 		{
 			if (params[SERVICE_STATUS] != str::Str(5))
 			{
-				sbin::ClientQuery("func=certificate.save&elid=" + str::Str(iid) + "&crt=" + str::url::Encode(crt.crt));
-				sbin::ClientQuery("func=certificate.open&sok=ok&elid=" + str::Str(iid));
-				SetServiceStatus(iid, 5 /* ssl_util::isIssued */);
-				SetServiceExpireDate(iid, crt.expire);
+				CertificateIssued(iid, crt);
 			}
 		}
 	}
@@ -967,10 +1516,18 @@ void Openprovider::SyncItem(int iid)
 		auto dom = Remote_GetDomain(params["domain"]);
 		if (dom.status == "ACT")
 		{
+			/* a transfer track_transfers has not seen finish yet */
+			if (params[TRANSFER_STARTED] != "")
+			{
+				SaveParam(iid, TRANSFER_STARTED, "");
+			}
+			if (params[REGISTRY_EXPIREDATE] != dom.expire)
+			{
+				SaveParam(iid, REGISTRY_EXPIREDATE, dom.expire);
+			}
 			if (params[SERVICE_STATUS] != str::Str(2))
 			{
-				sbin::ClientQuery("func=domain.open&sok=ok&service_status=2&elid=" + str::Str(iid));
-				SetServiceExpireDate(iid, dom.expire);
+				DomainActivated(iid, dom);
 			}
 		}
 	}
@@ -997,12 +1554,20 @@ void Openprovider::RegisterDomainContacts()
 		if (contact2handle[id] == "")
 		{
 			contact2handle[id] = Remote_CreateDomainCustomer(i);
-			sbin::ClientQuery("func=service_profile2processingmodule.edit"
+			BillingQuery("func=service_profile2processingmodule.edit"
 				"&sok=ok"
 				"&service_profile=" + id +
 				"&processingmodule=" + params["processingmodule"] +
 				"&externalid=" + contact2handle[id] +
 				"&type=owner");
+
+			/* a new handle already carries the current profile, sync_contacts must not resend it */
+			std::map<string, string> values;
+			for (auto j = Sql::Query("SELECT intname, value FROM service_profileparam WHERE service_profile = ?", { id }); !j->Eof(); j->Next())
+			{
+				values[j->AsString(0)] = j->AsString(1);
+			}
+			SaveContactHashes(str::Int(params["processingmodule"]), { { contact2handle[id], ProfileHash(params[i + "_profiletype"], values) } });
 		}
 	}
 }
@@ -1010,13 +1575,166 @@ void Openprovider::RegisterDomainContacts()
 void Openprovider::UpdateNS(int iid)
 {
 	Init(iid);
-	Remote_CreateDomain("modify");
+	Remote_CreateDomain(iid, "modify");
 }
 
-void Openprovider::Import(const int mid, const string& itemtype, const string& search)
+/* Nameservers of the module's NS group, "name" or "name/ip" entries */
+StringVector Openprovider::NsGroupServers()
+{
+	return SplitNameServers(ModuleParam("ns_group_servers"));
+}
+
+/* Marks the item as a member of the group and shows the group's nameservers in its ns0..ns4 */
+void Openprovider::SaveNsGroupMember(int iid, const string& group, const StringVector& servers)
+{
+	SaveParam(iid, NS_GROUP_MEMBER, group);
+	SaveParam(iid, NS_GROUP_MEMBER_SERVERS, JoinNameServers(servers));
+	for (size_t i = 0; i <= 4; ++i)
+	{
+		/* the last param takes whatever does not fit */
+		StringVector value;
+		if (i < 4)
+		{
+			if (i < servers.size())
+				value.push_back(servers[i]);
+		}
+		else if (servers.size() > 4)
+		{
+			value.assign(servers.begin() + 4, servers.end());
+		}
+		SaveParam(iid, "ns" + str::Str(i), JoinNameServers(value));
+	}
+}
+
+/*
+ * Creates the module's NS group on Openprovider or updates its nameservers
+ * to the module settings. All domains attached to the group follow with
+ * this single request, their ns0..ns4 params are then refreshed in billing.
+ * Active domains of the module not attached yet join the group when they
+ * have no nameservers, the group's new ones or its previous ones: one
+ * modifyDomainRequest each, sent by at most NS_GROUP_WORKERS threads, so a
+ * later change of the cluster is a single request for them too.
+ */
+void Openprovider::SyncNsGroup(int mid)
 {
-	auto db = sbin::DB();
+	SetModule(mid);
+	string group = ModuleParam("ns_group");
+	auto ns = NsGroupServers();
+	if (group.empty() || ns.empty())
+	{
+		throw mgr_err::Value("ns_group");
+	}
+
+	auto search = Remote_GetOpenxml();
+	search.GetRoot().AppendChild("searchNsGroupRequest").AppendChild("nsGroupPattern", group);
+	bool exists = false;
+	StringVector previous;
+	for (auto i : Remote_Send(search).GetNodes("//reply/data/results/array/item"))
+	{
+		if (i.FindNode("nsGroup").Str() == group)
+		{
+			exists = true;
+			for (auto j : i.GetNodes("nameServers/array/item"))
+			{
+				previous.push_back(Get(j, "name"));
+			}
+		}
+	}
+
+	auto q = Remote_GetOpenxml();
+	auto r = q.GetRoot().AppendChild(exists ? "modifyNsGroupRequest" : "createNsGroupRequest");
+	r.AppendChild("nsGroup", group);
+	AddNameServers(ns, r);
+	Remote_Send(q);
+	Debug("NS group %s %s with %zu nameservers", group.c_str(), exists ? "updated" : "created", ns.size());
+
+	struct Domain
+	{
+		int iid;
+		string domain;
+		bool member;
+		string memberServers;
+		StringVector ns;
+		bool attached = false;
+	};
+	std::vector<Domain> domains;
+	string joins;
+	for (int i = 0; i <= 4; ++i)
+	{
+		joins += " LEFT JOIN itemparam ns" + str::Str(i) + " ON ns" + str::Str(i) + ".item = i.id AND ns" + str::Str(i) + ".intname = 'ns" + str::Str(i) + "'";
+	}
+	for (auto i = Sql::Query(
+		"SELECT i.id, dom.value, mem.value, srv.value, ns0.value, ns1.value, ns2.value, ns3.value, ns4.value "
+		"FROM item i "
+		"JOIN itemtype it ON it.id = i.itemtype AND it.intname = 'domain' "
+		"JOIN itemparam st ON st.item = i.id AND st.intname = ? AND st.value = '2' "
+		"JOIN itemparam dom ON dom.item = i.id AND dom.intname = 'domain' "
+		"LEFT JOIN itemparam mem ON mem.item = i.id AND mem.intname = ? "
+		"LEFT JOIN itemparam srv ON srv.item = i.id AND srv.intname = ?" + joins + " "
+		"WHERE i.processingmodule = ?",
+		{ SERVICE_STATUS, NS_GROUP_MEMBER, NS_GROUP_MEMBER_SERVERS, str::Str(mid) }); !i->Eof(); i->Next())
+	{
+		Domain cur;
+		cur.iid = i->AsInt(0);
+		cur.domain = i->AsString(1);
+		cur.member = i->AsString(2) == group;
+		cur.memberServers = i->AsString(3);
+		for (int j = 4; j <= 8; ++j)
+		{
+			for (auto &k : SplitNameServers(i->AsString(j)))
+			{
+				cur.ns.push_back(k);
+			}
+		}
+		domains.push_back(std::move(cur));
+	}
 
+	std::vector<size_t> attach;
+	for (size_t i = 0; i < domains.size(); ++i)
+	{
+		auto &cur = domains[i];
+		auto set = NameServerSet(cur.ns);
+		if (!cur.member && (cur.ns.empty() || set == NameServerSet(ns) || (exists && set == NameServerSet(previous))))
+		{
+			attach.push_back(i);
+		}
+	}
+	Debug("%zu of %zu domains join NS group %s", attach.size(), domains.size(), group.c_str());
+
+	transport.ForEach(attach, NS_GROUP_WORKERS, [&](size_t idx)
+	{
+		auto &cur = domains[idx];
+		try
+		{
+			auto modify = Remote_GetOpenxml();
+			auto m = modify.GetRoot().AppendChild("modifyDomainRequest");
+			auto domain = m.AppendChild("domain");
+			string tld = cur.domain, dom = str::GetWord(tld, '.');
+			domain.AppendChild("name", dom);
+			domain.AppendChild("extension", tld);
+			m.AppendChild("nsGroup", group);
+			Remote_Send(modify);
+			cur.attached = true;
+		}
+		catch (mgr_err::Error& e)
+		{
+			Warning("Failed to attach %s to NS group %s: %s", cur.domain.c_str(), group.c_str(), e.what());
+		}
+	});
+
+	/* Billing writes stay on this thread: new members and members still showing other servers */
+	string servers = JoinNameServers(ns);
+	for (auto &cur : domains)
+	{
+		if (cur.attached || (cur.member && (cur.memberServers != servers || NameServerSet(cur.ns) != NameServerSet(ns))))
+		{
+			SaveNsGroupMember(cur.iid, group, ns);
+		}
+	}
+}
+
+void Openprovider::Import(const int mid, const string& itemtype, const string& search)
+{
 	SetModule(mid);
 	
 	params["processingmodule"] = str::Str(mid);
@@ -1025,85 +1743,157 @@ void Openprovider::Import(const int mid, const string& itemtype, const string& s
 	{
 		throw mgr_err::Error("unsupported", "itemtype");
 	}
-	StringMap filterParams;
-//	str::Split(search, ";", filterParams);
-	if (search != "")
+	/* Filters are sent with searchDomainRequest, one search per listed extension */
+	auto filter = openprovider::ParseImportFilter(search);
+	StringVector extensions = filter.extensions;
+	if (extensions.empty())
 	{
-		string tld = search, dom;
-		dom = str::GetWord(tld, '.');
-		filterParams["extension"] = tld;
-		filterParams["domainNamePattern"] = dom;
+		extensions.push_back("");
 	}
+	size_t part = 0;
 	int current = 0;
 	int total = 1;
 	int LIMIT = 100;
 
-	StringMap handle2contact;
+	HandleMemo handle2contact(IMPORT_HANDLE_CACHE);
+	ImportCheckpoint checkpoint;
+	/* "resume" continues an interrupted import with the same filter */
+	if (filter.resume && checkpoint.Load(mid) && checkpoint.search == filter.key)
+	{
+		part = checkpoint.part;
+		current = checkpoint.offset;
+		total = checkpoint.total;
+		for (auto &i : checkpoint.handles)
+		{
+			handle2contact.Set(i.first, i.second);
+		}
+		Debug("Resuming import from %d of %d", current, total);
+	}
+	checkpoint = ImportCheckpoint();
+	checkpoint.search = filter.key;
+	/* One page of records, reused so the memory of a page is released before the next one */
+	std::vector<DomainInfo> ret;
+	ret.reserve(LIMIT);
 
-	while (current < total)
+	for (; part < extensions.size(); ++part, current = 0, total = 1)
 	{
-		auto ret = Remote_SearchDomain(LIMIT, current, filterParams, &total);
-		current += LIMIT;
+		StringMap filterParams = filter.fields;
+		if (!extensions[part].empty())
+		{
+			filterParams["extension"] = extensions[part];
+		}
 
-		for (auto &i : ret)
+		/* The next page is fetched while the current one is being imported */
+		auto page = Remote_SendAsync(Remote_SearchDomainQuery(LIMIT, current, filterParams));
+		while (current < total)
 		{
-			StringMap domainParams;
-			domainParams["module"] = params["processingmodule"];
-			domainParams["import_itemtype_intname"] = "domain";
-			domainParams["import_pricelist_intname"] = GetDomainZoneCode(i.domain);
-			domainParams["import_service_name"] = i.domain;
-			domainParams["status"] = "2";
-			domainParams["expiredate"] = i.expire.operator string();
-			domainParams["domain"] = i.domain;
-			domainParams["service_status"] = "2";
-			domainParams["period"] = "12";
-			domainParams["sok"] = "ok";
-			for (auto &j : i.handles)
+			auto apiret = page.get();
 			{
-				if (handle2contact[j.second] == "")
-				{
-					auto q = db->Query("SELECT service_profile "
-						"FROM service_profile2processingmodule "
-						"WHERE processingmodule = " + params["processingmodule"] + " " +
-						"AND externalid=" + db->EscapeValue(j.second));
-
-					if (q->First())
-					{
-						handle2contact[j.second] = q->AsString(0);
-					}
-					else
-					{
-						handle2contact[j.second] = StoreContact(j.second);
-					}
-				}
-				domainParams[j.first] = handle2contact[j.second];
+				Phase phase("parse");
+				openprovider::ParseSearchDomain(apiret, ret, &total);
 			}
-			int nsIdx = 0;
-			for (auto &j : i.ns)
+			current += LIMIT;
+			if (current < total)
 			{
-				domainParams["ns" + str::Str(nsIdx++)] = j;
+				page = Remote_SendAsync(Remote_SearchDomainQuery(LIMIT, current, filterParams));
 			}
-			string elid = sbin::ClientQuery("processing.import.service", domainParams).value("service_id");
-			for (auto &j : i.handles)
+			/* the range is also checked here in case the server ignored it */
+			ret.erase(std::remove_if(ret.begin(), ret.end(), [&](const DomainInfo& i)
+			{
+				string expire = i.expire.operator string();
+				return (!filter.expireFrom.empty() && expire < filter.expireFrom) ||
+					(!filter.expireTo.empty() && expire > filter.expireTo);
+			}), ret.end());
+			ResolveHandles(ret, handle2contact);
+
+			for (auto &i : ret)
 			{
-				sbin::ClientQuery("service_profile2item.edit", {
-					{"sok", "ok"},
-					{"item", elid},
-					{"service_profile", handle2contact[j.second]},
-					{"type", j.first}
-				});
+				StringMap domainParams;
+				domainParams["module"] = params["processingmodule"];
+				domainParams["import_itemtype_intname"] = "domain";
+				domainParams["import_pricelist_intname"] = GetDomainZoneCode(i.domain);
+				domainParams["import_service_name"] = i.domain;
+				domainParams["status"] = "2";
+				domainParams["expiredate"] = i.expire.operator string();
+				domainParams["domain"] = std::move(i.domain);
+				domainParams["service_status"] = "2";
+				domainParams["period"] = "12";
+				domainParams["sok"] = "ok";
+				for (auto &j : i.handles)
+				{
+					domainParams[j.first] = handle2contact.Get(j.second);
+				}
+				int nsIdx = 0;
+				for (auto &j : i.ns)
+				{
+					domainParams["ns" + str::Str(nsIdx++)] = std::move(j);
+				}
+				string elid = BillingQuery("processing.import.service", domainParams).value("service_id");
+				for (auto &j : i.handles)
+				{
+					BillingQuery("service_profile2item.edit", {
+						{"sok", "ok"},
+						{"item", elid},
+						{"service_profile", handle2contact.Get(j.second)},
+						{"type", j.first}
+					});
+				}
 			}
+
+			checkpoint.part = part;
+			checkpoint.offset = current;
+			checkpoint.total = total;
+			checkpoint.handles = handle2contact.Dump();
+			checkpoint.Save(mid);
 		}
 	}
+	ImportCheckpoint::Remove(mid);
 }
 
-string Openprovider::StoreContact(const string& extid)
+void Openprovider::ResolveHandles(const std::vector<DomainInfo>& domains, HandleMemo& handle2contact)
+{
+	std::set<string> unknown;
+	string contact;
+	for (auto &i : domains)
+	{
+		for (auto &j : i.handles)
+		{
+			if (!handle2contact.Find(j.second, contact))
+			{
+				unknown.insert(j.second);
+			}
+		}
+	}
+	if (unknown.empty())
+	{
+		return;
+	}
+
+	StringVector args = { params["processingmodule"] };
+	args.insert(args.end(), unknown.begin(), unknown.end());
+	for (auto i = Sql::Query("SELECT externalid, service_profile "
+		"FROM service_profile2processingmodule "
+		"WHERE processingmodule = ? "
+		"AND externalid IN (" + Sql::Placeholders(unknown.size()) + ")", args); !i->Eof(); i->Next())
+	{
+		handle2contact.Set(i->AsString(0), i->AsString(1));
+		unknown.erase(i->AsString(0));
+	}
+
+	/* Openprovider lookups run concurrently on the transport, billing writes stay on this thread */
+	std::vector<std::pair<string, std::future<mgr_xml::Xml>>> replies;
+	for (auto &i : unknown)
+	{
+		replies.emplace_back(i, Remote_SendAsync(Remote_GetCustomerQuery(i)));
+	}
+	for (auto &i : replies)
+	{
+		handle2contact.Set(i.first, StoreContact(i.first, i.second.get()));
+	}
+}
+
+string Openprovider::StoreContact(const string& extid, mgr_xml::Xml apiret)
 {
-	auto q = Remote_GetOpenxml();
-	auto r = q.GetRoot().AppendChild("retrieveCustomerRequest");
-	r.AppendChild("handle", extid);
-	r.AppendChild("withAdditionalData", "true");
-	auto apiret = Remote_Send(q);
 	auto data = apiret.GetNode("//reply/data");
 	auto ad = data.FindNode("additionalData");
 	StringMap contactParams;
@@ -1119,24 +1909,800 @@ string Openprovider::StoreContact(const string& extid)
 	auto address = data.FindNode("address");
 	contactParams["location_address"] = Get(address, "street") + " " + Get(address, "number");
 	contactParams["location_city"] = Get(address, "city");
-	contactParams["location_country"] = CountryCodeRev(Get(address, "country"));
 	contactParams["location_postcode"] = Get(address, "zipcode");
 	contactParams["location_state"] = Get(address, "state");
 	contactParams["passport"] = Get(ad, "passportNumber");
 	contactParams["phone"] = Get(data, "phone");
 	contactParams["profiletype"] = "1";
 	contactParams["name"] = contactParams["firstname"] + " " + contactParams["lastname"] + " (" + extid + ")";
-	auto ret = sbin::ClientQuery("processing.import.profile", contactParams);
+	contactParams["location_country"] = CountryCodeRev(Get(address, "country"));
+	auto ret = BillingQuery("processing.import.profile", contactParams);
 	return ret.value("profile_id");
 }
 
+namespace
+{
+	/* Form a name is checked, cached and reported under: lowercase, IDNs in punycode */
+	string CheckName(const string& name)
+	{
+		return str::Lower(str::puny::Encode(str::Lower(name)));
+	}
+}
+
+/*
+ * Availability of many domains at once. `domains` holds full names or bare
+ * names, the latter are combined with every extension from `tlds`. Names
+ * are checked in concurrent chunks, results are shared by all module
+ * processes for CHECK_DOMAIN_TTL seconds.
+ */
+mgr_xml::Xml Openprovider::CheckDomains(int mid, const string& domains, const string& tlds)
+{
+	SetModule(mid);
+
+	StringVector names, extensions;
+	str::Split(domains, " ", names);
+	str::Split(tlds, " ", extensions);
+	std::set<string> wanted;
+	for (auto &i : names)
+	{
+		string name = str::Trim(i);
+		if (name.empty())
+		{
+			continue;
+		}
+		if (name.find('.') != string::npos)
+		{
+			wanted.insert(CheckName(name));
+		}
+		else
+		{
+			for (auto &j : extensions)
+			{
+				if (!str::Trim(j).empty())
+				{
+					wanted.insert(CheckName(name + "." + str::Trim(j)));
+				}
+			}
+		}
+	}
+
+	string keyPrefix = ModuleParam("url") + "\n" + ModuleParam("login") + "\ncheckDomain\n";
+	StringMap status;
+	StringVector unknown;
+	for (auto &i : wanted)
+	{
+		string cached;
+		if (checkCache.Get(keyPrefix + i, cached))
+		{
+			status[i] = cached;
+		}
+		else
+		{
+			unknown.push_back(i);
+		}
+	}
+
+	std::vector<std::future<mgr_xml::Xml>> replies;
+	for (size_t i = 0; i < unknown.size(); i += CHECK_DOMAIN_CHUNK)
+	{
+		auto q = Remote_GetOpenxml();
+		auto array = q.GetRoot().AppendChild("checkDomainRequest").AppendChild("domains").AppendChild("array");
+		for (size_t j = i; j < unknown.size() && j < i + CHECK_DOMAIN_CHUNK; ++j)
+		{
+			string tld = unknown[j], dom = str::GetWord(tld, '.');
+			auto item = array.AppendChild("item");
+			item.AppendChild("name", dom);
+			item.AppendChild("extension", tld);
+		}
+		replies.push_back(Remote_SendAsync(q));
+	}
+	for (auto &i : replies)
+	{
+		auto apiret = i.get();
+		for (auto j : apiret.GetNodes("//reply/data/array/item"))
+		{
+			string domain = CheckName(j.FindNode("domain").Str());
+			status[domain] = j.FindNode("status").Str();
+			checkCache.Put(keyPrefix + domain, status[domain], CHECK_DOMAIN_TTL);
+		}
+	}
+
+	mgr_xml::Xml ret;
+	auto root = ret.SetRoot("domains");
+	for (auto &i : wanted)
+	{
+		root.AppendChild("domain").SetProp("name", i).SetProp("status", status[i]);
+	}
+	return ret;
+}
+
+namespace
+{
+	/* Amounts are compared as text, so both sides are brought to two decimals */
+	string Money(double value)
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%.2f", value);
+		return buf;
+	}
+
+	string Money(const string& value)
+	{
+		return Money(str::Double(value));
+	}
+
+	/* Reseller price of one operation from a searchExtensionRequest item, "" if not sold */
+	string ResellerPrice(const mgr_xml::XmlNode& prices, const string& operation, string& currency)
+	{
+		auto price = prices ? prices.FindNode(operation) : prices;
+		auto reseller = price ? price.FindNode("reseller") : price;
+		if (!reseller || Get(reseller, "price").empty())
+		{
+			return "";
+		}
+		currency = Get(reseller, "currency");
+		return Money(Get(reseller, "price"));
+	}
+}
+
+/*
+ * Registration prices of all extensions and SSL products plus the module's
+ * price_markup percent, compared with the period prices of the matching
+ * billing pricelists. A domain period of several years costs the yearly
+ * price times the years, an SSL period needs a product price of the same
+ * length. Extension pages after the first are requested concurrently, the
+ * billing side is read in one query, and only periods whose price changed
+ * are saved, one pricelist.period.edit each: billing has no transaction
+ * spanning API calls. Without a markup nothing is saved, so a missing
+ * setting never turns sale prices into purchase prices. Changed and skipped
+ * periods are printed.
+ */
+mgr_xml::Xml Openprovider::SyncPrices(int mid)
+{
+	SetModule(mid);
+
+	struct Price
+	{
+		int period; /* months */
+		string currency;
+		double price;
+	};
+	/* product -> prices, product is a tld name or "op_<id>" */
+	std::multimap<string, Price> offers;
+
+	auto page = [&](int offset)
+	{
+		auto q = Remote_GetOpenxml();
+		auto r = q.GetRoot().AppendChild("searchExtensionRequest");
+		r.AppendChild("limit", str::Str(PRICE_SYNC_PAGE));
+		r.AppendChild("offset", str::Str(offset));
+		r.AppendChild("withPrice", "1");
+		return q;
+	};
+	auto extensions = [&](mgr_xml::Xml apiret)
+	{
+		for (auto i : apiret.GetNodes("//reply/data/results/array/item"))
+		{
+			Price cur;
+			cur.period = 12;
+			string price = ResellerPrice(i.FindNode("prices"), "createPrice", cur.currency);
+			if (!price.empty())
+			{
+				cur.price = str::Double(price);
+				offers.insert({ Get(i, "name"), cur });
+			}
+		}
+	};
+
+	auto first = Remote_Send(page(0));
+	int total = str::Int(first.GetNode("//reply/data/total").Str());
+	std::vector<std::future<mgr_xml::Xml>> pages;
+	for (int offset = PRICE_SYNC_PAGE; offset < total; offset += PRICE_SYNC_PAGE)
+	{
+		pages.push_back(Remote_SendAsync(page(offset)));
+	}
+	auto ssl = Remote_GetOpenxml();
+	auto r = ssl.GetRoot().AppendChild("searchProductSslCertRequest");
+	r.AppendChild("limit", "999");
+	r.AppendChild("withPrice", "1");
+	auto sslReply = Remote_SendAsync(ssl);
+
+	extensions(first);
+	for (auto &i : pages)
+	{
+		extensions(i.get());
+	}
+	for (auto i : sslReply.get().GetNodes("//reply/data/results/array/item"))
+	{
+		for (auto j : i.GetNodes("prices/array/item"))
+		{
+			auto price = j.FindNode("price");
+			auto reseller = price ? price.FindNode("reseller") : price;
+			if (!reseller || Get(reseller, "price").empty())
+			{
+				continue;
+			}
+			Price cur;
+			cur.period = str::Int(Get(j, "period")) * 12;
+			cur.currency = Get(reseller, "currency");
+			cur.price = str::Double(Get(reseller, "price"));
+			offers.insert({ "op_" + Get(i, "id"), cur });
+		}
+	}
+	Debug("%zu prices received", offers.size());
+
+	/* Domain pricelists are named by tld id, SSL ones by template name */
+	StringVector tlds;
+	for (auto i = offers.begin(); i != offers.end(); i = offers.upper_bound(i->first))
+	{
+		if (i->first.compare(0, 3, "op_") != 0)
+		{
+			tlds.push_back(i->first);
+		}
+	}
+	StringMap intname2product;
+	if (!tlds.empty())
+	{
+		for (auto i = Sql::Query("SELECT id, name FROM tld WHERE name IN (" + Sql::Placeholders(tlds.size()) + ")", tlds); !i->Eof(); i->Next())
+		{
+			intname2product[i->AsString(0)] = i->AsString(1);
+		}
+	}
+	for (auto i = offers.begin(); i != offers.end(); i = offers.upper_bound(i->first))
+	{
+		if (i->first.compare(0, 3, "op_") == 0)
+		{
+			intname2product[i->first] = i->first;
+		}
+	}
+	StringVector intnames;
+	for (auto &i : intname2product)
+	{
+		intnames.push_back(i.first);
+	}
+
+	mgr_xml::Xml ret;
+	auto root = ret.SetRoot("prices");
+	if (intnames.empty())
+	{
+		return ret;
+	}
+	string markup = ModuleParam("price_markup");
+	bool apply = !markup.empty();
+	double factor = 1 + str::Double(markup) / 100;
+	root.SetProp("markup", markup).SetProp("applied", apply ? "yes" : "no");
+
+	size_t checked = 0, changed = 0;
+	for (auto i = Sql::Query("SELECT pp.id, p.id, p.intname, pp.length, pp.cost, c.iso "
+		"FROM pricelist p "
+		"JOIN pricelistperiod pp ON pp.pricelist = p.id "
+		"JOIN currency c ON c.id = p.currency "
+		"WHERE p.intname IN (" + Sql::Placeholders(intnames.size()) + ")", intnames); !i->Eof(); i->Next())
+	{
+		string product = intname2product[i->AsString(2)];
+		int length = i->AsInt(3);
+		auto skipped = [&](const string& reason)
+		{
+			return root.AppendChild("skipped")
+				.SetProp("pricelist", i->AsString(1))
+				.SetProp("period", i->AsString(3))
+				.SetProp("reason", reason);
+		};
+
+		const Price* offer = nullptr;
+		double cost = 0;
+		auto range = offers.equal_range(product);
+		for (auto j = range.first; j != range.second && !offer; ++j)
+		{
+			if (product.compare(0, 3, "op_") != 0)
+			{
+				/* extensions are priced per year */
+				if (length > 0 && length % 12 == 0)
+				{
+					offer = &j->second;
+					cost = j->second.price * (length / 12);
+				}
+			}
+			else if (j->second.period == length)
+			{
+				offer = &j->second;
+				cost = j->second.price;
+			}
+		}
+		if (!offer)
+		{
+			skipped("period");
+			continue;
+		}
+		++checked;
+		if (offer->currency != i->AsString(5))
+		{
+			skipped("currency")
+				.SetProp("currency", i->AsString(5))
+				.SetProp("offer_currency", offer->currency);
+			continue;
+		}
+
+		string old = Money(i->AsString(4));
+		string price = Money(cost * factor);
+		if (old == price)
+		{
+			continue;
+		}
+		if (apply)
+		{
+			BillingQuery("pricelist.period.edit", {
+				{ "elid", i->AsString(0) },
+				{ "plid", i->AsString(1) },
+				{ "cost", price },
+				{ "sok", "ok" } });
+		}
+		++changed;
+		root.AppendChild("price")
+			.SetProp("pricelist", i->AsString(1))
+			.SetProp("period", i->AsString(3))
+			.SetProp("currency", offer->currency)
+			.SetProp("purchase", Money(cost))
+			.SetProp("old", old)
+			.SetProp("new", price);
+	}
+	Debug("%zu of %zu prices changed", changed, checked);
+	return ret;
+}
+
+/*
+ * Sends modifyCustomerRequest for every handle of the module whose service
+ * profile changed since it was last sent. Changes are detected by comparing
+ * a hash of the profile params with the one kept in the module's state file,
+ * the requests are built here and sent by at most CONTACT_SYNC_WORKERS
+ * threads.
+ * A handle without a stored hash only has it recorded: its profile may have
+ * been created from the customer itself and is not pushed back.
+ */
+mgr_xml::Xml Openprovider::SyncContacts(int mid)
+{
+	SetModule(mid);
+
+	struct Contact
+	{
+		string profile;
+		string handle;
+		string profiletype;
+		std::map<string, string> values;
+		string hash;
+		mgr_xml::Xml request;
+		bool sent = false;
+	};
+	std::vector<Contact> contacts;
+	for (auto i = Sql::Query(
+		"SELECT sp2pm.service_profile, sp2pm.externalid, sp.profiletype, spp.intname, spp.value "
+		"FROM service_profile2processingmodule sp2pm "
+		"JOIN service_profile sp ON sp.id = sp2pm.service_profile "
+		"JOIN service_profileparam spp ON spp.service_profile = sp2pm.service_profile "
+		"WHERE sp2pm.processingmodule = ? AND sp2pm.externalid != '' "
+		"ORDER BY sp2pm.service_profile", { str::Str(mid) }); !i->Eof(); i->Next())
+	{
+		if (contacts.empty() || contacts.back().profile != i->AsString(0))
+		{
+			Contact cur;
+			cur.profile = i->AsString(0);
+			cur.handle = i->AsString(1);
+			cur.profiletype = i->AsString(2);
+			contacts.push_back(std::move(cur));
+		}
+		contacts.back().values[i->AsString(3)] = i->AsString(4);
+	}
+
+	auto stored = LoadContactHashes(mid);
+	std::vector<size_t> changed;
+	StringMap seeded;
+	for (size_t i = 0; i < contacts.size(); ++i)
+	{
+		auto &cur = contacts[i];
+		cur.hash = ProfileHash(cur.profiletype, cur.values);
+		auto it = stored.find(cur.handle);
+		if (it == stored.end())
+		{
+			seeded[cur.handle] = cur.hash;
+			continue;
+		}
+		if (it->second == cur.hash)
+		{
+			continue;
+		}
+		/* same params layout as Init() gives a domain contact */
+		params.clear();
+		for (auto &j : cur.values)
+		{
+			params["owner_" + j.first] = Transliterate(j.second);
+			params["owner_" + j.first + "_ru"] = j.second;
+		}
+		params["owner_profiletype"] = cur.profiletype;
+		cur.request = Remote_ModifyDomainCustomerQuery(cur.handle, "owner");
+		changed.push_back(i);
+	}
+	Debug("%zu of %zu contacts changed, %zu seen for the first time", changed.size(), contacts.size(), seeded.size());
+	SaveContactHashes(mid, seeded);
+
+	transport.ForEach(changed, CONTACT_SYNC_WORKERS, [&](size_t idx)
+	{
+		auto &cur = contacts[idx];
+		try
+		{
+			Remote_Send(cur.request);
+			cur.sent = true;
+			cache.Erase(CacheKey(Remote_GetCustomerQuery(cur.handle).Str()));
+		}
+		catch (mgr_err::Error& e)
+		{
+			Warning("Failed to modify customer %s: %s", cur.handle.c_str(), e.what());
+		}
+	});
+
+	mgr_xml::Xml ret;
+	auto root = ret.SetRoot("contacts");
+	StringMap sent;
+	for (auto i : changed)
+	{
+		auto &cur = contacts[i];
+		root.AppendChild("contact")
+			.SetProp("handle", cur.handle)
+			.SetProp("profile", cur.profile)
+			.SetProp("status", cur.sent ? "modified" : "failed");
+		if (cur.sent)
+		{
+			sent[cur.handle] = cur.hash;
+		}
+	}
+	SaveContactHashes(mid, sent);
+	return ret;
+}
+
+void Openprovider::CertificateIssued(int iid, const OrderInfo& crt)
+{
+	BillingQuery("func=certificate.save&elid=" + str::Str(iid) + "&crt=" + str::url::Encode(crt.crt));
+	BillingQuery("func=certificate.open&sok=ok&elid=" + str::Str(iid));
+	SetServiceStatus(iid, 5 /* ssl_util::isIssued */);
+	SetServiceExpireDate(iid, crt.expire);
+}
+
+void Openprovider::SyncCertificates(int mid)
+{
+	SetModule(mid);
+
+	/* Orders of requested (3) and issued (5) certificates known to billing */
+	struct Cert
+	{
+		int iid;
+		string status;
+		string expire;
+	};
+	std::map<string, Cert> orders;
+	for (auto i = Sql::Query(
+		"SELECT i.id, oid.value, st.value, i.expiredate "
+		"FROM item i "
+		"JOIN itemtype it ON it.id = i.itemtype AND it.intname = 'certificate' "
+		"JOIN itemparam oid ON oid.item = i.id AND oid.intname = ? "
+		"JOIN itemparam st ON st.item = i.id AND st.intname = ? "
+		"WHERE i.processingmodule = ? AND st.value IN ('3', '5')",
+		{ SERVICE_ORDER_ID, SERVICE_STATUS, str::Str(mid) }); !i->Eof(); i->Next())
+	{
+		Cert cur;
+		cur.iid = i->AsInt(0);
+		cur.status = i->AsString(2);
+		cur.expire = i->AsString(3);
+		orders[i->AsString(1)] = cur;
+	}
+	if (orders.empty())
+	{
+		return;
+	}
+
+	/*
+	 * Every active order is listed: the search offers no modification date,
+	 * and an expiration date may change long after activation. Full
+	 * certificate bodies are fetched only for orders that newly reached ACT.
+	 */
+	std::vector<std::pair<int, std::future<mgr_xml::Xml>>> issued;
+	int offset = 0, total = 1;
+	while (offset < total)
+	{
+		auto q = Remote_GetOpenxml();
+		auto r = q.GetRoot().AppendChild("searchOrderSslCertRequest");
+		r.AppendChild("limit", str::Str(CERT_SYNC_PAGE));
+		r.AppendChild("offset", str::Str(offset));
+		r.AppendChild("status").AppendChild("array").AppendChild("item", "ACT");
+		auto apiret = Remote_Send(q);
+		total = str::Int(apiret.GetNode("//reply/data/total").Str());
+		offset += CERT_SYNC_PAGE;
+
+		for (auto i : apiret.GetNodes("//reply/data/results/array/item"))
+		{
+			auto it = orders.find(i.FindNode("id").Str());
+			if (it == orders.end())
+			{
+				continue;
+			}
+			if (it->second.status == "3")
+			{
+				issued.emplace_back(it->second.iid, Remote_SendAsync(Remote_GetCertQuery(it->first)));
+				continue;
+			}
+			string expire = i.FindNode("expirationDate").Str();
+			expire = str::GetWord(expire, ' ');
+			if (expire != "" && expire != it->second.expire)
+			{
+				SetServiceExpireDate(it->second.iid, expire);
+			}
+		}
+	}
+
+	for (auto &i : issued)
+	{
+		try
+		{
+			auto crt = Remote_GetCertParse(i.second.get());
+			if (crt.status == "ACT")
+			{
+				CertificateIssued(i.first, crt);
+			}
+		}
+		catch (mgr_err::Error& e)
+		{
+			Warning("Failed to sync certificate of item %d: %s", i.first, e.what());
+		}
+	}
+}
+
+void Openprovider::ProlongBulk(int mid)
+{
+	SetModule(mid);
+
+	/*
+	 * Billing moves expiredate forward when a prolong is paid, while the registry
+	 * expiration date seen by the last sync is kept in REGISTRY_EXPIREDATE.
+	 * Every active domain whose paid date is a renewal ahead of it is due.
+	 * Domains without a known registry date are only seeded with it: nothing
+	 * is renewed or confirmed for them in this run.
+	 */
+	struct Due
+	{
+		int iid;
+		string domain;
+		string paid;
+		string registry;
+		bool renewed = false;
+	};
+	std::vector<Due> due, seed;
+	for (auto i = Sql::Query(
+		"SELECT i.id, dom.value, i.expiredate, reg.value "
+		"FROM item i "
+		"JOIN itemtype it ON it.id = i.itemtype AND it.intname = 'domain' "
+		"JOIN itemparam dom ON dom.item = i.id AND dom.intname = 'domain' "
+		"LEFT JOIN itemparam reg ON reg.item = i.id AND reg.intname = ? "
+		"WHERE i.processingmodule = ? "
+		"AND i.status = 2 "
+		"AND (reg.value IS NULL OR reg.value < i.expiredate)", { REGISTRY_EXPIREDATE, str::Str(mid) }); !i->Eof(); i->Next())
+	{
+		Due cur;
+		cur.iid = i->AsInt(0);
+		cur.domain = i->AsString(1);
+		cur.paid = i->AsString(2);
+		if (i->AsString(3).empty())
+		{
+			seed.push_back(std::move(cur));
+		}
+		else if (RenewYears(i->AsString(3), cur.paid) > 0)
+		{
+			due.push_back(std::move(cur));
+		}
+	}
+	Debug("%zu domains are due for renewal, %zu to seed", due.size(), seed.size());
+
+	transport.ForEach(seed, PROLONG_BULK_WORKERS, [&](Due& cur)
+	{
+		try
+		{
+			cur.registry = Remote_GetDomain(cur.domain, true).expire;
+		}
+		catch (mgr_err::Error& e)
+		{
+			Warning("Failed to read registry date of %s: %s", cur.domain.c_str(), e.what());
+		}
+	});
+	for (auto &i : seed)
+	{
+		if (!i.registry.empty())
+		{
+			SaveParam(i.iid, REGISTRY_EXPIREDATE, i.registry);
+		}
+	}
+
+	/*
+	 * The registry date is always re-read before renewing, so an item that was
+	 * renewed by an interrupted earlier run is only confirmed, never renewed twice.
+	 */
+	openprovider::RateLimiter limiter(PROLONG_BULK_RATE);
+	transport.ForEach(due, PROLONG_BULK_WORKERS, [&](Due& cur)
+	{
+		try
+		{
+			ItemLock lock(cur.iid);
+			auto dom = Remote_GetDomain(cur.domain, true);
+			if (dom.status != "ACT")
+			{
+				Warning("Domain %s is not active (%s), skipping renewal", cur.domain.c_str(), dom.status.c_str());
+				return;
+			}
+			if (int years = RenewYears(dom.expire, cur.paid))
+			{
+				limiter.Wait();
+				Remote_RenewDomain(cur.domain, years);
+				dom = Remote_GetDomain(cur.domain, true);
+				if (RenewYears(dom.expire, cur.paid) > 0)
+				{
+					Warning("Renewal of %s is not confirmed, registry expiration date is %s", cur.domain.c_str(), dom.expire.c_str());
+					return;
+				}
+			}
+			cur.registry = dom.expire;
+			cur.renewed = true;
+		}
+		catch (mgr_err::Error& e)
+		{
+			Warning("Failed to renew %s: %s", cur.domain.c_str(), e.what());
+		}
+	});
+
+	string confirmed;
+	int batch = 0;
+	for (auto &i : due)
+	{
+		if (!i.renewed)
+		{
+			continue;
+		}
+		SaveParam(i.iid, REGISTRY_EXPIREDATE, i.registry);
+		confirmed += (confirmed.empty() ? "" : ", ") + str::Str(i.iid);
+		if (++batch == PROLONG_BULK_BATCH)
+		{
+			BillingQuery("func=service.postprolong&sok=ok&elid=" + str::url::Encode(confirmed));
+			confirmed.clear();
+			batch = 0;
+		}
+	}
+	if (!confirmed.empty())
+	{
+		BillingQuery("func=service.postprolong&sok=ok&elid=" + str::url::Encode(confirmed));
+	}
+}
+
+void Openprovider::DomainActivated(int iid, const OrderInfo& dom)
+{
+	BillingQuery("func=domain.open&sok=ok&service_status=2&elid=" + str::Str(iid));
+	SetServiceExpireDate(iid, dom.expire);
+}
+
+/*
+ * Status of every transfer started by Transfer() and not yet finished. A
+ * transfer is due when a check falls between the previous run and now, with
+ * checks spaced by TransferCheckInterval() of its age. Due transfers still
+ * listed by a search for pending domains are skipped, only the others are
+ * retrieved one by one. Completed ones are opened right away.
+ */
+void Openprovider::TrackTransfers(int mid)
+{
+	SetModule(mid);
+
+	struct Pending
+	{
+		int iid;
+		string domain;
+	};
+	static const std::set<string> pendingStatus = { "REQ", "PEN", "SCH" };
+	long now = time(nullptr);
+	string statePath = "var/pmopenprovider_transfers_" + str::Str(mid) + ".xml";
+	long last = 0;
+	mgr_xml::Xml state;
+	if (LoadState(statePath, state))
+	{
+		last = atol(state.GetRoot().GetProp("last").c_str());
+	}
+
+	std::vector<Pending> due;
+	for (auto i = Sql::Query(
+		"SELECT i.id, dom.value, st.value "
+		"FROM item i "
+		"JOIN itemparam st ON st.item = i.id AND st.intname = ? "
+		"JOIN itemparam dom ON dom.item = i.id AND dom.intname = 'domain' "
+		"WHERE i.processingmodule = ? AND st.value != ''", { TRANSFER_STARTED, str::Str(mid) }); !i->Eof(); i->Next())
+	{
+		long started = atol(i->AsString(2).c_str());
+		long interval = openprovider::TransferCheckInterval(now - started);
+		if (last > started && (now - started) / interval == (last - started) / interval)
+		{
+			continue;
+		}
+		Pending cur;
+		cur.iid = i->AsInt(0);
+		cur.domain = i->AsString(1);
+		due.push_back(std::move(cur));
+	}
+	Debug("%zu transfers are due for a check", due.size());
+
+	if (!due.empty())
+	{
+		std::set<string> pending;
+		std::vector<DomainInfo> page;
+		for (auto &status : pendingStatus)
+		{
+			int offset = 0, total = 1;
+			while (offset < total)
+			{
+				openprovider::ParseSearchDomain(Remote_Send(Remote_SearchDomainQuery(TRANSFER_PAGE, offset, { { "status", status } })), page, &total);
+				offset += TRANSFER_PAGE;
+				for (auto &i : page)
+				{
+					pending.insert(i.domain);
+				}
+			}
+		}
+
+		std::vector<std::pair<const Pending*, std::future<mgr_xml::Xml>>> finished;
+		for (auto &i : due)
+		{
+			if (!pending.count(i.domain))
+			{
+				auto q = Remote_GetDomainQuery(i.domain);
+				cache.Erase(CacheKey(q.Str()));
+				finished.emplace_back(&i, Remote_SendAsync(q));
+			}
+		}
+		for (auto &i : finished)
+		{
+			try
+			{
+				auto data = i.second.get().GetNode("//reply/data");
+				OrderInfo dom;
+				dom.status = data.FindNode("status").Str();
+				if (pendingStatus.count(dom.status))
+				{
+					continue;
+				}
+				SaveParam(i.first->iid, TRANSFER_STARTED, "");
+				if (dom.status == "ACT")
+				{
+					string expire = data.FindNode("expirationDate").Str();
+					dom.expire = str::GetWord(expire, ' ');
+					SaveParam(i.first->iid, REGISTRY_EXPIREDATE, dom.expire);
+					DomainActivated(i.first->iid, dom);
+				}
+				else
+				{
+					Warning("Transfer of %s ended with status %s", i.first->domain.c_str(), dom.status.c_str());
+				}
+			}
+			catch (mgr_err::Error& e)
+			{
+				Warning("Failed to check transfer of %s: %s", i.first->domain.c_str(), e.what());
+			}
+		}
+	}
+
+	mgr_xml::Xml done;
+	done.SetRoot("transfers").SetProp("last", str::Str(now));
+	SaveState(statePath, done);
+}
+
 void Openprovider::Transfer(int iid, StringMap&)
 {
 	Init(iid);
 	RegisterDomainContacts();
-	Remote_CreateDomain("transfer");
+	Remote_CreateDomain(iid, "transfer");
+	/* Finished by track_transfers, or by SyncItem if that is not scheduled; cleared below if already active */
+	SaveParam(iid, TRANSFER_STARTED, str::Str(time(nullptr)));
 	SyncItem(iid);
-	sbin::ClientQuery("func=service.postopen&sok=ok&elid=" + str::Str(iid));
+	BillingQuery("func=service.postopen&sok=ok&elid=" + str::Str(iid));
 }
 
 RUN_MODULE(processing::Openprovider)
@@ -0,0 +1,236 @@
+#include "pmopenprovider_cache.h"
+#include <mgr/mgrlog.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MODULE("pmopenprovider_cache");
+
+using namespace std;
+
+namespace
+{
+	const uint64_t CACHE_MAGIC = 0x4f50434143484532ULL; /* "OPCACHE2" */
+	const size_t PROBE_COUNT = 8;
+
+	struct Header
+	{
+		uint64_t magic;
+		uint64_t slots;
+		uint64_t slotSize;
+	};
+
+	/*
+	 * Second key hash stored next to Hash(), so two keys share a slot only if
+	 * both collide. Multiply-xorshift, unrelated to FNV.
+	 */
+	uint64_t Check(const string& data)
+	{
+		uint64_t h = 0x9e3779b97f4a7c15ULL ^ data.size();
+		for (unsigned char c : data)
+		{
+			h = (h ^ c) * 0xff51afd7ed558ccdULL;
+			h ^= h >> 32;
+		}
+		return h;
+	}
+
+	/* flock() based lock, released on scope exit */
+	class FileLock
+	{
+		public:
+			FileLock(int fd, int op): m_fd(fd)
+			{
+				while (flock(m_fd, op) != 0 && errno == EINTR)
+					;
+			}
+			~FileLock()
+			{
+				flock(m_fd, LOCK_UN);
+			}
+		private:
+			int m_fd;
+	};
+}
+
+namespace openprovider
+{
+	struct SharedCache::Slot
+	{
+		uint64_t hash;
+		uint64_t check;
+		int64_t expire;
+		uint32_t len;
+		uint32_t reserved;
+		char data[1];
+	};
+
+	SharedCache::SharedCache(const string& path, size_t slots, size_t slotSize):
+		m_path(path), m_slots(slots), m_slotSize(slotSize)
+	{
+	}
+
+	SharedCache::~SharedCache()
+	{
+		if (m_map)
+			munmap(m_map, m_size);
+		if (m_fd >= 0)
+			close(m_fd);
+	}
+
+	uint64_t SharedCache::Hash(const string& data)
+	{
+		/* FNV-1a, 0 is reserved for empty slots */
+		uint64_t h = 0xcbf29ce484222325ULL;
+		for (unsigned char c : data)
+		{
+			h ^= c;
+			h *= 0x100000001b3ULL;
+		}
+		return h ? h : 1;
+	}
+
+	bool SharedCache::Open()
+	{
+		if (m_map)
+			return true;
+		if (m_failed)
+			return false;
+
+		m_size = sizeof(Header) + m_slots * m_slotSize;
+		m_fd = open(m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if (m_fd < 0)
+		{
+			Warning("Cache '%s' is disabled: open failed (%d)", m_path.c_str(), errno);
+			m_failed = true;
+			return false;
+		}
+
+		FileLock lock(m_fd, LOCK_EX);
+		struct stat st;
+		if (fstat(m_fd, &st) != 0 || (static_cast<size_t>(st.st_size) != m_size && ftruncate(m_fd, m_size) != 0))
+		{
+			Warning("Cache '%s' is disabled: resize failed (%d)", m_path.c_str(), errno);
+			m_failed = true;
+			return false;
+		}
+		void* map = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+		if (map == MAP_FAILED)
+		{
+			Warning("Cache '%s' is disabled: mmap failed (%d)", m_path.c_str(), errno);
+			m_failed = true;
+			return false;
+		}
+		m_map = static_cast<char*>(map);
+
+		auto header = reinterpret_cast<Header*>(m_map);
+		if (header->magic != CACHE_MAGIC || header->slots != m_slots || header->slotSize != m_slotSize)
+		{
+			Debug("Initializing cache '%s'", m_path.c_str());
+			memset(m_map, 0, sizeof(Header));
+			for (size_t i = 0; i < m_slots; ++i)
+			{
+				At(i)->hash = 0;
+			}
+			header->slots = m_slots;
+			header->slotSize = m_slotSize;
+			header->magic = CACHE_MAGIC;
+		}
+		return true;
+	}
+
+	SharedCache::Slot* SharedCache::At(size_t idx)
+	{
+		return reinterpret_cast<Slot*>(m_map + sizeof(Header) + idx * m_slotSize);
+	}
+
+	SharedCache::Slot* SharedCache::Find(uint64_t hash, uint64_t check, bool forWrite)
+	{
+		int64_t now = time(nullptr);
+		Slot* victim = nullptr;
+		bool victimFree = false;
+		for (size_t i = 0; i < PROBE_COUNT; ++i)
+		{
+			Slot* slot = At((hash + i) % m_slots);
+			if (slot->hash == hash && slot->check == check)
+			{
+				return (forWrite || slot->expire > now) ? slot : nullptr;
+			}
+			if (!forWrite)
+			{
+				continue;
+			}
+			/* Reuse a free or expired slot, otherwise evict the one expiring first */
+			if (slot->hash == 0 || slot->expire <= now)
+			{
+				if (!victimFree)
+				{
+					victim = slot;
+					victimFree = true;
+				}
+			}
+			else if (!victim || (!victimFree && slot->expire < victim->expire))
+			{
+				victim = slot;
+			}
+		}
+		return victim;
+	}
+
+	bool SharedCache::Get(const string& key, string& value)
+	{
+		uint64_t hash = Hash(key), check = Check(key);
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (!Open())
+			return false;
+		FileLock lock(m_fd, LOCK_SH);
+		Slot* slot = Find(hash, check, false);
+		if (!slot)
+			return false;
+		value.assign(slot->data, slot->len);
+		return true;
+	}
+
+	void SharedCache::Put(const string& key, const string& value, int ttl)
+	{
+		if (ttl <= 0 || value.size() > m_slotSize - offsetof(Slot, data))
+			return;
+		uint64_t hash = Hash(key), check = Check(key);
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (!Open())
+			return;
+		FileLock lock(m_fd, LOCK_EX);
+		Slot* slot = Find(hash, check, true);
+		if (!slot)
+			return;
+		memcpy(slot->data, value.data(), value.size());
+		slot->len = value.size();
+		slot->expire = time(nullptr) + ttl;
+		slot->check = check;
+		slot->hash = hash;
+	}
+
+	void SharedCache::Erase(const string& key)
+	{
+		uint64_t hash = Hash(key), check = Check(key);
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (!Open())
+			return;
+		FileLock lock(m_fd, LOCK_EX);
+		for (size_t i = 0; i < PROBE_COUNT; ++i)
+		{
+			Slot* slot = At((hash + i) % m_slots);
+			if (slot->hash == hash && slot->check == check)
+			{
+				slot->hash = 0;
+				slot->expire = 0;
+			}
+		}
+	}
+}
@@ -0,0 +1,49 @@
+#ifndef PMOPENPROVIDER_CACHE_H
+#define PMOPENPROVIDER_CACHE_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace openprovider
+{
+	/*
+	 * Reply cache shared by all module processes. Entries live in a
+	 * memory-mapped file split into fixed-size slots and are guarded by
+	 * flock() on the same file, so forked processes see each other's
+	 * entries without any daemon. Threads of one process are serialized
+	 * by a mutex, as flock() does not lock them out of each other.
+	 */
+	class SharedCache
+	{
+		public:
+			SharedCache(const std::string& path, size_t slots = 1024, size_t slotSize = 256 * 1024);
+			~SharedCache();
+			SharedCache(const SharedCache&) = delete;
+			SharedCache& operator=(const SharedCache&) = delete;
+
+			bool Get(const std::string& key, std::string& value);
+			void Put(const std::string& key, const std::string& value, int ttl);
+			void Erase(const std::string& key);
+
+			static uint64_t Hash(const std::string& data);
+
+		private:
+			struct Slot;
+			bool Open();
+			Slot* At(size_t idx);
+			Slot* Find(uint64_t hash, uint64_t check, bool forWrite);
+
+			std::string m_path;
+			size_t m_slots;
+			size_t m_slotSize;
+			int m_fd = -1;
+			char* m_map = nullptr;
+			size_t m_size = 0;
+			bool m_failed = false;
+			std::mutex m_lock;
+	};
+}
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef PMOPENPROVIDER_POOL_H
+#define PMOPENPROVIDER_POOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace openprovider
+{
+	/*
+	 * Threads running submitted jobs. A thread is started only when a job
+	 * finds no idle one, up to `threads`, so a command sending one request
+	 * at a time runs a single thread. A job submitted from one of the
+	 * executor's own threads runs inline, so nested submits can not exhaust
+	 * the pool and deadlock.
+	 */
+	class Executor
+	{
+		public:
+			explicit Executor(size_t threads): size(threads) {}
+			Executor(const Executor&) = delete;
+			Executor& operator=(const Executor&) = delete;
+
+			~Executor()
+			{
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					stopping = true;
+				}
+				ready.notify_all();
+				for (auto& i : workers)
+				{
+					i.join();
+				}
+			}
+
+			template <class F>
+			std::future<typename std::result_of<F()>::type> Submit(F fn)
+			{
+				typedef typename std::result_of<F()>::type Result;
+				auto task = std::make_shared<std::packaged_task<Result()>>(std::move(fn));
+				auto ret = task->get_future();
+				if (Current() == this)
+				{
+					(*task)();
+					return ret;
+				}
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					jobs.push_back([task]() { (*task)(); });
+					if (jobs.size() > idle && workers.size() < size)
+					{
+						workers.emplace_back([this]() { Run(); });
+					}
+				}
+				ready.notify_one();
+				return ret;
+			}
+
+			/*
+			 * Calls fn for every element of items on the executor with at most
+			 * `limit` calls in flight. The first exception stops handing out new
+			 * elements and is rethrown once the started calls are finished.
+			 */
+			template <class Container, class Func>
+			void ForEach(Container& items, size_t limit, Func fn)
+			{
+				std::deque<std::future<void>> running;
+				std::exception_ptr error;
+				auto wait = [&]()
+				{
+					try
+					{
+						running.front().get();
+					}
+					catch (...)
+					{
+						if (!error)
+						{
+							error = std::current_exception();
+						}
+					}
+					running.pop_front();
+				};
+				for (auto& i : items)
+				{
+					while (!running.empty() && (running.size() >= limit || error))
+					{
+						wait();
+					}
+					if (error)
+					{
+						break;
+					}
+					running.push_back(Submit([&fn, &i]() { fn(i); }));
+				}
+				while (!running.empty())
+				{
+					wait();
+				}
+				if (error)
+				{
+					std::rethrow_exception(error);
+				}
+			}
+
+		private:
+			void Run()
+			{
+				Current() = this;
+				for (;;)
+				{
+					std::function<void()> job;
+					{
+						std::unique_lock<std::mutex> guard(lock);
+						++idle;
+						ready.wait(guard, [this]() { return stopping || !jobs.empty(); });
+						--idle;
+						if (jobs.empty())
+						{
+							return;
+						}
+						job = std::move(jobs.front());
+						jobs.pop_front();
+					}
+					job();
+				}
+			}
+
+			static Executor*& Current()
+			{
+				static thread_local Executor* current = nullptr;
+				return current;
+			}
+
+			size_t size;
+			size_t idle = 0;
+			bool stopping = false;
+			std::mutex lock;
+			std::condition_variable ready;
+			std::deque<std::function<void()>> jobs;
+			std::vector<std::thread> workers;
+	};
+
+	/* Spaces Wait() returns of all threads at least 1/perSecond seconds apart */
+	class RateLimiter
+	{
+		public:
+			explicit RateLimiter(double perSecond):
+				interval(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1 / perSecond))),
+				next(std::chrono::steady_clock::now())
+			{
+			}
+
+			void Wait()
+			{
+				std::chrono::steady_clock::time_point slot;
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					auto now = std::chrono::steady_clock::now();
+					if (next < now)
+					{
+						next = now;
+					}
+					slot = next;
+					next += interval;
+				}
+				std::this_thread::sleep_until(slot);
+			}
+
+		private:
+			std::chrono::steady_clock::duration interval;
+			std::chrono::steady_clock::time_point next;
+			std::mutex lock;
+	};
+}
+
+#endif
@@ -0,0 +1,194 @@
+#include "pmopenprovider_profile.h"
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <sys/resource.h>
+
+using namespace std;
+
+namespace
+{
+	bool enabled = false;
+	std::atomic<uint64_t> totalAllocs(0);
+	std::atomic<uint64_t> totalBytes(0);
+	/* Allocations of the current thread, phases take differences of these */
+	thread_local uint64_t threadAllocs = 0;
+	thread_local uint64_t threadBytes = 0;
+
+	inline void Count(size_t size)
+	{
+		if (enabled)
+		{
+			++threadAllocs;
+			threadBytes += size;
+			totalAllocs.fetch_add(1, std::memory_order_relaxed);
+			totalBytes.fetch_add(size, std::memory_order_relaxed);
+		}
+	}
+
+	int64_t Now(clockid_t clock)
+	{
+		timespec ts;
+		clock_gettime(clock, &ts);
+		return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+	}
+
+	struct Stat
+	{
+		uint64_t calls = 0;
+		int64_t cpu = 0;
+		int64_t wall = 0;
+		uint64_t allocs = 0;
+		uint64_t bytes = 0;
+	};
+
+	/* Never destroyed, so phases ending during exit still have somewhere to go */
+	std::mutex& Lock()
+	{
+		static std::mutex* lock = new std::mutex;
+		return *lock;
+	}
+	std::map<string, Stat>& Stats()
+	{
+		static std::map<string, Stat>* stats = new std::map<string, Stat>;
+		return *stats;
+	}
+
+	string CommandLine()
+	{
+		std::ifstream in("/proc/self/cmdline");
+		string ret, arg;
+		while (std::getline(in, arg, '\0'))
+		{
+			ret += (ret.empty() ? "" : " ") + arg;
+		}
+		return ret;
+	}
+
+	void Report()
+	{
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		double cpu = usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3 +
+			usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3;
+
+		std::lock_guard<std::mutex> guard(Lock());
+		fprintf(stderr, "profile: %s\n", CommandLine().c_str());
+		fprintf(stderr, "%-14s %8s %12s %12s %12s %14s\n", "phase", "calls", "cpu ms", "wall ms", "allocs", "bytes");
+		for (auto &i : Stats())
+		{
+			fprintf(stderr, "%-14s %8llu %12.3f %12.3f %12llu %14llu\n", i.first.c_str(),
+				static_cast<unsigned long long>(i.second.calls), i.second.cpu / 1e6, i.second.wall / 1e6,
+				static_cast<unsigned long long>(i.second.allocs), static_cast<unsigned long long>(i.second.bytes));
+		}
+		fprintf(stderr, "%-14s %8s %12.3f %12s %12llu %14llu\n", "process", "", cpu, "",
+			static_cast<unsigned long long>(totalAllocs.load()), static_cast<unsigned long long>(totalBytes.load()));
+	}
+
+	struct Init
+	{
+		Init()
+		{
+			const char* env = getenv("PMOPENPROVIDER_PROFILE");
+			if (env && *env && string(env) != "0")
+			{
+				enabled = true;
+				atexit(Report);
+			}
+		}
+	} init;
+}
+
+namespace openprovider
+{
+	namespace profile
+	{
+		bool Enabled()
+		{
+			return enabled;
+		}
+
+		Phase::Phase(const char* name):
+			m_name(name)
+		{
+			if (enabled)
+			{
+				m_cpu = Now(CLOCK_THREAD_CPUTIME_ID);
+				m_wall = Now(CLOCK_MONOTONIC);
+				m_allocs = threadAllocs;
+				m_bytes = threadBytes;
+			}
+		}
+
+		Phase::~Phase()
+		{
+			if (!enabled)
+				return;
+			int64_t cpu = Now(CLOCK_THREAD_CPUTIME_ID) - m_cpu;
+			int64_t wall = Now(CLOCK_MONOTONIC) - m_wall;
+			uint64_t allocs = threadAllocs - m_allocs;
+			uint64_t bytes = threadBytes - m_bytes;
+			std::lock_guard<std::mutex> guard(Lock());
+			auto &stat = Stats()[m_name];
+			++stat.calls;
+			stat.cpu += cpu;
+			stat.wall += wall;
+			stat.allocs += allocs;
+			stat.bytes += bytes;
+		}
+	}
+}
+
+/*
+ * Replaced global allocation functions, counting while accounting is enabled.
+ * Kept out of line so the compiler does not pair malloc() with inlined frees.
+ */
+__attribute__((noinline)) void* operator new(size_t size)
+{
+	Count(size);
+	if (void* ret = malloc(size ? size : 1))
+		return ret;
+	throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+__attribute__((noinline)) void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	Count(size);
+	return malloc(size ? size : 1);
+}
+
+__attribute__((noinline)) void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	return operator new(size, std::nothrow);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept
+{
+	free(ptr);
+}
+
+__attribute__((noinline)) void operator delete[](void* ptr) noexcept
+{
+	free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+__attribute__((noinline)) void operator delete[](void* ptr, size_t) noexcept
+{
+	free(ptr);
+}
@@ -0,0 +1,38 @@
+#ifndef PMOPENPROVIDER_PROFILE_H
+#define PMOPENPROVIDER_PROFILE_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace openprovider
+{
+	/*
+	 * Accounting mode, enabled by PMOPENPROVIDER_PROFILE=1 in the environment.
+	 * Heap allocations are counted by the replaced global operator new, phases
+	 * measure the CPU time and allocations of the thread that runs them. A
+	 * summary per phase goes to stderr when the process exits.
+	 */
+	namespace profile
+	{
+		bool Enabled();
+
+		class Phase
+		{
+			public:
+				/* name must be a string literal */
+				explicit Phase(const char* name);
+				~Phase();
+				Phase(const Phase&) = delete;
+				Phase& operator=(const Phase&) = delete;
+
+			private:
+				const char* m_name;
+				int64_t m_cpu = 0;
+				int64_t m_wall = 0;
+				uint64_t m_allocs = 0;
+				uint64_t m_bytes = 0;
+		};
+	}
+}
+
+#endif
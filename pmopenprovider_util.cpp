@@ -0,0 +1,325 @@
+#include "pmopenprovider_util.h"
+#include <mgr/mgrlog.h>
+#include <algorithm>
+
+MODULE("pmopenprovider");
+
+using namespace std;
+
+string SafeSubstr(const string &s, size_t begin, size_t end) {
+	return s.size() > begin ? s.substr(begin, end) : string();
+}
+
+static inline const wchar_t* TransliterateSymb(WCHAR c)
+{
+	switch (c)
+	{
+		case L'А': return L"A";
+		case L'Б': return L"B";
+		case L'В': return L"V";
+		case L'Г': return L"G";
+		case L'Д': return L"D";
+		case L'Е': return L"E";
+		case L'Ё': return L"Yo";
+		case L'Ж': return L"J";
+		case L'З': return L"Z";
+		case L'И': return L"I";
+		case L'Й': return L"J";
+		case L'К': return L"K";
+		case L'Л': return L"L";
+		case L'М': return L"M";
+		case L'Н': return L"N";
+		case L'О': return L"O";
+		case L'П': return L"P";
+		case L'Р': return L"R";
+		case L'С': return L"S";
+		case L'Т': return L"T";
+		case L'У': return L"U";
+		case L'Ф': return L"F";
+		case L'Х': return L"H";
+		case L'Ц': return L"Ts";
+		case L'Ч': return L"Ch";
+		case L'Ш': return L"Sh";
+		case L'Щ': return L"Sch";
+		case L'Ъ': return L"";
+		case L'Ы': return L"Y";
+		case L'Ь': return L"";
+		case L'Э': return L"E";
+		case L'Ю': return L"Yu";
+		case L'Я': return L"Ya";
+		case L'а': return L"a";
+		case L'б': return L"b";
+		case L'в': return L"v";
+		case L'г': return L"g";
+		case L'д': return L"d";
+		case L'е': return L"e";
+		case L'ё': return L"yo";
+		case L'ж': return L"j";
+		case L'з': return L"z";
+		case L'и': return L"i";
+		case L'й': return L"j";
+		case L'к': return L"k";
+		case L'л': return L"l";
+		case L'м': return L"m";
+		case L'н': return L"n";
+		case L'о': return L"o";
+		case L'п': return L"p";
+		case L'р': return L"r";
+		case L'с': return L"s";
+		case L'т': return L"t";
+		case L'у': return L"u";
+		case L'ф': return L"f";
+		case L'х': return L"h";
+		case L'ц': return L"ts";
+		case L'ч': return L"ch";
+		case L'ш': return L"sh";
+		case L'щ': return L"sch";
+		case L'ъ': return L"";
+		case L'ы': return L"y";
+		case L'ь': return L"";
+		case L'э': return L"e";
+		case L'ю': return L"yu";
+		case L'я': return L"ya";
+		default: return NULL;
+	}
+}
+
+string processing::Transliterate(const string& arg)
+{
+	str::u16string ret;
+	for (auto i : str::u16string(arg).operator str::u16string::base_type())
+	{
+		const wchar_t *j = TransliterateSymb(i);
+		if (!j)
+		{
+			ret.push_back(i);
+		}
+		else
+		{
+			while (*j)
+			{
+				ret.push_back(*j++);
+			}
+		}
+	}
+	return str::u16string(ret);
+}
+
+namespace openprovider
+{
+	std::vector<std::string> DomainHandleTypes()
+	{
+		return { "owner", "admin", "bill", "tech" };
+	}
+
+	void AddPhone(string phone, mgr_xml::XmlNode& r)
+	{
+		StringVector ret;
+		if (!phone.size() || phone[0] != '+')
+		{
+			phone = "+" + phone;
+		}
+		str::inpl::Replace(phone, "(", "");
+		str::inpl::Replace(phone, ")", "");
+		str::inpl::Replace(phone, "-", "");
+		str::Split(phone, ret, " ");
+		if (ret.size() != 3)
+		{
+			ret.clear();
+			str::inpl::Replace(phone, " ", "");
+			ret.push_back(phone.substr(0, 2));
+			ret.push_back(phone.substr(2, 3));
+			ret.push_back(phone.substr(5));
+		}
+
+		auto &phoneList = ret;
+		auto phoneNode = r.AppendChild("phone");
+		phoneNode.AppendChild("countryCode", phoneList[0]);
+		phoneNode.AppendChild("areaCode", phoneList[1]);
+		phoneNode.AppendChild("subscriberNumber", phoneList[2]);
+	}
+
+	void AddAddress(const string& address1, mgr_xml::XmlNode& address)
+	{
+		string address0 = address1, number;
+		while (!address0.empty() && isdigit(*address0.rbegin()))
+		{
+			number = *address0.rbegin() + number;
+			address0.resize(address0.size() - 1);
+		}
+		if (number.empty())
+		{
+			number = "1";
+		}
+		address.AppendChild("street", address0);
+		address.AppendChild("number", number);
+	}
+
+	void AddName(const string& fname, const string& lname, mgr_xml::XmlNode &r)
+	{
+		auto name = r.AppendChild("name");
+		name.AppendChild("firstName", fname);
+		name.AppendChild("lastName", lname);
+		if (!fname.empty() && !lname.empty())
+		{
+			name.AppendChild("initials", fname[0] + string(".") + lname[0] + ".");
+		}
+		r.AppendChild("gender", "M");
+	}
+
+	void AddNameServers(const StringVector& ns, mgr_xml::XmlNode& r)
+	{
+		auto array = r.AppendChild("nameServers").AppendChild("array");
+		for (auto &i : ns)
+		{
+			StringVector parts;
+			str::Split(i, "/", parts);
+			if (parts.size() == 0)
+			{
+				continue;
+			}
+			auto item = array.AppendChild("item");
+			item.AppendChild("name", parts[0]);
+			if (parts.size() == 2)
+			{
+				item.AppendChild("ip", parts[1]);
+			}
+		}
+	}
+
+	int RenewYears(const string& registry, const string& paid)
+	{
+		/* whole months, a paid date a few days ahead of the registry is not a renewal */
+		int months = (str::Int(SafeSubstr(paid, 0, 4)) - str::Int(SafeSubstr(registry, 0, 4))) * 12 +
+			str::Int(SafeSubstr(paid, 5, 2)) - str::Int(SafeSubstr(registry, 5, 2));
+		if (str::Int(SafeSubstr(paid, 8, 2)) < str::Int(SafeSubstr(registry, 8, 2)))
+		{
+			--months;
+		}
+		return months > 0 ? (months + 11) / 12 : 0;
+	}
+
+	long TransferCheckInterval(long age)
+	{
+		if (age < 3600)
+			return 300;
+		if (age < 86400)
+			return 1800;
+		if (age < 3 * 86400)
+			return 7200;
+		return 21600;
+	}
+
+	ImportFilter ParseImportFilter(const string& search)
+	{
+		ImportFilter ret;
+		StringVector terms;
+		str::Split(search, ";", terms);
+		for (auto &i : terms)
+		{
+			string value = str::Trim(i), name = str::GetWord(value, '=');
+			if (name == "resume" && value.empty())
+			{
+				ret.resume = true;
+				continue;
+			}
+			if (name.empty())
+			{
+				continue;
+			}
+			ret.key += (ret.key.empty() ? "" : ";") + str::Trim(i);
+			if (i.find('=') == string::npos)
+			{
+				/* bare "name.ext" */
+				string tld = name, dom = str::GetWord(tld, '.');
+				ret.fields["domainNamePattern"] = dom;
+				if (!tld.empty())
+				{
+					ret.extensions = { tld };
+				}
+			}
+			else if (name == "name")
+				ret.fields["domainNamePattern"] = value;
+			else if (name == "ext")
+			{
+				StringVector ext;
+				str::Split(value, ",", ext);
+				for (auto &j : ext)
+				{
+					if (!str::Trim(j).empty())
+						ret.extensions.push_back(str::Trim(j));
+				}
+			}
+			else if (name == "contact")
+				ret.fields["contactHandle"] = value;
+			else if (name == "status")
+				ret.fields["status"] = value;
+			else if (name == "nsgroup")
+				ret.fields["nsGroupPattern"] = value;
+			else if (name == "expire")
+			{
+				auto pos = value.find("..");
+				ret.expireFrom = value.substr(0, pos);
+				ret.expireTo = pos == string::npos ? value : value.substr(pos + 2);
+				if (!ret.expireFrom.empty())
+					ret.fields["expirationDateFrom"] = ret.expireFrom;
+				if (!ret.expireTo.empty())
+					ret.fields["expirationDateTo"] = ret.expireTo;
+			}
+			else
+				throw mgr_err::Error("search", "unknown_term", name);
+		}
+		return ret;
+	}
+
+	void ParseSearchDomain(mgr_xml::Xml apiret, std::vector<DomainInfo>& ret, int* total)
+	{
+		auto data = apiret.GetNode("//reply/data");
+		if (total)
+		{
+			*total = str::Int(data.FindNode("total").Str());
+		}
+
+		ret.clear();
+		for (auto i : apiret.GetNodes("//reply/data/results/array/item"))
+		{
+			Debug("prep");
+			DomainInfo cur;
+			auto domNode = i.FindNode("domain");
+			cur.domain = domNode.FindNode("name").Str() + "." + domNode.FindNode("extension").Str();
+			Debug("dom %s", cur.domain.c_str());
+			for (auto j : DomainHandleTypes())
+			{
+				Debug("Getting contact %s", j.c_str());
+				string handle = i.FindNode((j == "bill" ? "billing" : j) + "Handle").Str();
+				if (handle != "")
+				{
+					cur.handles[j] = handle;
+				}
+			}
+			auto nsNode = i.FindNode("nameServers");
+
+			if (nsNode)
+			{
+				auto arr = nsNode.FindNode("array");
+				for (auto j = arr.FirstChild(); j; j = j.Next())
+				{
+					/* j = <item> */
+					cur.ns.push_back(j.FindNode("name").Str());
+				}
+			}
+			Debug("Getting exp");
+			string exp = i.FindNode("expirationDate").Str();
+			try
+			{
+				cur.expire = mgr_date::Date(str::GetWord(exp, ' '));
+			}
+			catch (mgr_err::Error&)
+			{
+				cur.expire = mgr_date::Date(static_cast<time_t>(0));
+			}
+			ret.push_back(std::move(cur));
+			Debug("Got exp");
+		}
+	}
+}
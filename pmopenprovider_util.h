@@ -0,0 +1,65 @@
+#ifndef PMOPENPROVIDER_UTIL_H
+#define PMOPENPROVIDER_UTIL_H
+
+#include <mgr/mgrstr.h>
+#include <mgr/mgrxml.h>
+#include <mgr/mgrdate.h>
+#include <string>
+#include <vector>
+
+/*
+ * Pure helpers of the module: no database, network or module state, so
+ * they are shared by the module binary and the benchmark.
+ */
+
+std::string SafeSubstr(const std::string &s, size_t begin, size_t end = std::string::npos);
+
+namespace processing
+{
+	std::string Transliterate(const std::string& arg);
+}
+
+namespace openprovider
+{
+	struct DomainInfo { std::string domain; StringMap handles; StringVector ns; mgr_date::Date expire; };
+
+	std::vector<std::string> DomainHandleTypes();
+
+	void AddPhone(std::string phone, mgr_xml::XmlNode& r);
+	void AddAddress(const std::string& address1, mgr_xml::XmlNode& address);
+	void AddName(const std::string& fname, const std::string& lname, mgr_xml::XmlNode &r);
+	/* <nameServers> of "name" or "name/ip" entries */
+	void AddNameServers(const StringVector& ns, mgr_xml::XmlNode& r);
+
+	/*
+	 * Years to renew so the registry expiration date (YYYY-MM-DD) covers the
+	 * paid one, 0 if it already does. Billing prolongs in whole months, so
+	 * the paid date counts as covered unless it is a full month ahead.
+	 */
+	int RenewYears(const std::string& registry, const std::string& paid);
+
+	/* Seconds between status checks of a transfer started `age` seconds ago */
+	long TransferCheckInterval(long age);
+
+	/*
+	 * Import search string: ";"-separated terms, each either "resume",
+	 * "name.ext" as before, or one of
+	 *   name=<pattern> ext=<ext>[,<ext>...] contact=<handle> status=<status>
+	 *   nsgroup=<pattern> expire=[<from>]..[<to>] (YYYY-MM-DD, inclusive)
+	 */
+	struct ImportFilter
+	{
+		bool resume = false;
+		StringVector extensions;
+		StringMap fields; /* searchDomainRequest fields */
+		std::string expireFrom;
+		std::string expireTo;
+		std::string key; /* the filter without "resume", identifies an import */
+	};
+	ImportFilter ParseImportFilter(const std::string& search);
+
+	/* Fills ret with the domains of a searchDomainRequest reply */
+	void ParseSearchDomain(mgr_xml::Xml apiret, std::vector<DomainInfo>& ret, int* total = nullptr);
+}
+
+#endif
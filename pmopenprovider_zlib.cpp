@@ -0,0 +1,143 @@
+#include "pmopenprovider_zlib.h"
+#include <cctype>
+#include <cstring>
+
+using namespace std;
+
+namespace
+{
+	const size_t CHUNK = 16384;
+
+	bool IsGzip(const string& head)
+	{
+		return static_cast<unsigned char>(head[0]) == 0x1f && static_cast<unsigned char>(head[1]) == 0x8b;
+	}
+
+	bool IsZlib(const string& head)
+	{
+		unsigned char b0 = head[0], b1 = head[1];
+		return (b0 & 0x0f) == Z_DEFLATED && (b0 * 256 + b1) % 31 == 0;
+	}
+
+	/* Replies are XML: optional BOM or whitespace, then '<' */
+	bool IsText(const string& head)
+	{
+		unsigned char b0 = head[0];
+		return b0 == '<' || b0 == 0xef || isspace(b0);
+	}
+}
+
+namespace openprovider
+{
+	InflateBuf::InflateBuf(ostream& out):
+		m_out(out)
+	{
+		memset(&m_zs, 0, sizeof(m_zs));
+	}
+
+	InflateBuf::~InflateBuf()
+	{
+		if (m_zsInit)
+			inflateEnd(&m_zs);
+	}
+
+	InflateBuf::int_type InflateBuf::overflow(int_type c)
+	{
+		if (!traits_type::eq_int_type(c, traits_type::eof()))
+		{
+			char ch = traits_type::to_char_type(c);
+			Feed(&ch, 1);
+		}
+		return traits_type::not_eof(c);
+	}
+
+	streamsize InflateBuf::xsputn(const char* s, streamsize n)
+	{
+		Feed(s, n);
+		return n;
+	}
+
+	void InflateBuf::Feed(const char* data, size_t size)
+	{
+		if (m_state == Detect)
+		{
+			m_head.append(data, size);
+			if (m_head.size() < 2)
+				return;
+			if (IsText(m_head))
+			{
+				m_state = Plain;
+			}
+			else
+			{
+				/* 15 + 32 detects gzip and zlib headers, -15 is raw deflate */
+				int bits = IsGzip(m_head) || IsZlib(m_head) ? 15 + 32 : -15;
+				m_state = inflateInit2(&m_zs, bits) == Z_OK ? Compressed : Failed;
+				m_zsInit = m_state == Compressed;
+			}
+			string head;
+			head.swap(m_head);
+			Feed(head.data(), head.size());
+			return;
+		}
+		if (m_state == Plain)
+		{
+			m_out.write(data, size);
+		}
+		else if (m_state == Compressed)
+		{
+			Inflate(data, size);
+		}
+	}
+
+	void InflateBuf::Inflate(const char* data, size_t size)
+	{
+		char buf[CHUNK];
+		m_zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		m_zs.avail_in = size;
+		while (m_state == Compressed && m_zs.avail_in > 0)
+		{
+			m_zs.next_out = reinterpret_cast<Bytef*>(buf);
+			m_zs.avail_out = sizeof(buf);
+			int rc = inflate(&m_zs, Z_NO_FLUSH);
+			m_out.write(buf, sizeof(buf) - m_zs.avail_out);
+			if (rc == Z_STREAM_END)
+			{
+				m_state = Done;
+			}
+			else if (rc != Z_OK && !(rc == Z_BUF_ERROR && m_zs.avail_out != 0))
+			{
+				m_state = Failed;
+			}
+		}
+	}
+
+	bool InflateBuf::Finish()
+	{
+		if (m_state == Detect)
+		{
+			/* a body shorter than the two detection bytes can only be text */
+			m_state = Plain;
+			m_out << m_head;
+			m_head.clear();
+		}
+		return m_state == Plain || m_state == Done;
+	}
+
+	bool Gzip(const string& data, string& ret)
+	{
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return false;
+		ret.resize(deflateBound(&zs, data.size()));
+		zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+		zs.avail_in = data.size();
+		zs.next_out = reinterpret_cast<Bytef*>(&ret[0]);
+		zs.avail_out = ret.size();
+		int rc = deflate(&zs, Z_FINISH);
+		ret.resize(ret.size() - zs.avail_out);
+		deflateEnd(&zs);
+		return rc == Z_STREAM_END;
+	}
+}
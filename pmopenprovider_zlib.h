@@ -0,0 +1,47 @@
+#ifndef PMOPENPROVIDER_ZLIB_H
+#define PMOPENPROVIDER_ZLIB_H
+
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <zlib.h>
+
+namespace openprovider
+{
+	/*
+	 * Output buffer that decompresses a reply body while it is being
+	 * received. gzip, zlib and raw deflate bodies are inflated into `out`,
+	 * anything starting like plain text is passed through unchanged.
+	 */
+	class InflateBuf : public std::streambuf
+	{
+		public:
+			explicit InflateBuf(std::ostream& out);
+			~InflateBuf();
+			InflateBuf(const InflateBuf&) = delete;
+			InflateBuf& operator=(const InflateBuf&) = delete;
+
+			/* false if the body was compressed and is broken or truncated */
+			bool Finish();
+
+		protected:
+			int_type overflow(int_type c) override;
+			std::streamsize xsputn(const char* s, std::streamsize n) override;
+
+		private:
+			enum State { Detect, Plain, Compressed, Done, Failed };
+			void Feed(const char* data, size_t size);
+			void Inflate(const char* data, size_t size);
+
+			std::ostream& m_out;
+			State m_state = Detect;
+			std::string m_head;
+			z_stream m_zs;
+			bool m_zsInit = false;
+	};
+
+	/* gzip-compresses data into out, false if zlib failed */
+	bool Gzip(const std::string& data, std::string& out);
+}
+
+#endif